@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#ifdef CLOX_AOT_THREAD
+#include <pthread.h>
+#endif
+#include "aot.h"
+#include "compiler.h"
+
+// the functions of a script, numbered in the order listFunctions() finds them
+typedef struct
+{
+    ObjFunction** functions;
+    int count;
+    int capacity;
+} FunctionList;
+
+/// adds a function and the functions declared in it to the list, depth first in the order of their constants. the
+/// emitter and the compiled program both number the functions this way
+/// @param list     the list
+/// @param function the function to add
+static void listFunctions(FunctionList* list, ObjFunction* function)
+{
+    // a plain allocation, the functions aren't rooted and the GC must not run
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        list->functions = realloc(list->functions, sizeof(ObjFunction*) * list->capacity);
+        if (list->functions == NULL) exit(1);
+    }
+    list->functions[list->count++] = function;
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        if (IS_FUNCTION(constants->values[i])) listFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+}
+
+/// @return the length of the instruction at `offset`, operands included
+static int instructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+    case OP_SET_LOCAL_POP:
+        return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_ADD_LOCALS:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+        return 4;
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 5;
+    case OP_CLOSURE:
+        return 2 + 2 * AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]])->upvalueCount;
+    default:
+        return 1;
+    }
+}
+
+/// @return the offset a jump or loop instruction goes to, -1 for the other instructions
+static int jumpTarget(Chunk* chunk, int offset)
+{
+    uint8_t* ip = &chunk->code[offset];
+    switch (ip[0])
+    {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+        return offset + 3 + (ip[1] << 8 | ip[2]);
+    case OP_LOOP:
+        return offset + 5 - (ip[1] << 8 | ip[2]);
+    default:
+        return -1;
+    }
+}
+
+/// writes the C statements of one instruction
+/// @param out    the C file
+/// @param chunk  the function's chunk
+/// @param offset the instruction's offset
+/// @return       the offset of the next instruction
+static int emitInstruction(FILE* out, Chunk* chunk, int offset)
+{
+    uint8_t* ip = &chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+
+    fprintf(out, "    ");
+    switch (ip[0])
+    {
+    case OP_CONSTANT:
+        fprintf(out, "AOT_CONSTANT(%d);\n", ip[1]);
+        break;
+    case OP_CONSTANT_LONG:
+        fprintf(out, "AOT_CONSTANT(%u);\n", (uint32_t)ip[3] << 16 | (uint16_t)ip[2] << 8 | ip[1]);
+        break;
+    case OP_NIL:
+        fprintf(out, "AOT_NIL();\n");
+        break;
+    case OP_TRUE:
+        fprintf(out, "AOT_TRUE();\n");
+        break;
+    case OP_FALSE:
+        fprintf(out, "AOT_FALSE();\n");
+        break;
+    case OP_POP:
+        fprintf(out, "AOT_POP();\n");
+        break;
+    case OP_GET_LOCAL:
+        fprintf(out, "AOT_GET_LOCAL(%d);\n", ip[1]);
+        break;
+    case OP_SET_LOCAL:
+        fprintf(out, "AOT_SET_LOCAL(%d);\n", ip[1]);
+        break;
+    case OP_SET_LOCAL_POP:
+        fprintf(out, "AOT_SET_LOCAL(%d);\n    AOT_POP();\n", ip[1]);
+        break;
+    case OP_GET_UPVALUE:
+        fprintf(out, "AOT_GET_UPVALUE(%d);\n", ip[1]);
+        break;
+    case OP_SET_UPVALUE:
+        fprintf(out, "AOT_SET_UPVALUE(%d);\n", ip[1]);
+        break;
+    case OP_CLOSE_UPVALUE:
+        fprintf(out, "AOT_CLOSE_UPVALUE();\n");
+        break;
+    case OP_GET_GLOBAL:
+        fprintf(out, "AOT_GET_GLOBAL(%d, %d);\n", ip[1] << 8 | ip[2], next);
+        break;
+    case OP_SET_GLOBAL:
+        fprintf(out, "AOT_SET_GLOBAL(%d, %d);\n", ip[1] << 8 | ip[2], next);
+        break;
+    case OP_DEFINE_GLOBAL:
+        fprintf(out, "AOT_DEFINE_GLOBAL(%d);\n", ip[1] << 8 | ip[2]);
+        break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+        fprintf(out, "AOT_ADD(%d);\n", next);
+        break;
+    case OP_ADD_LOCALS:
+        fprintf(out, "AOT_GET_LOCAL(%d);\n    AOT_GET_LOCAL(%d);\n    AOT_ADD(%d);\n", ip[1], ip[2], next);
+        break;
+    case OP_ADD_CONSTANT:
+        fprintf(out, "AOT_CONSTANT(%d);\n    AOT_ADD(%d);\n", ip[1], next);
+        break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+        fprintf(out, "AOT_BINARY(NUMBER_VAL, -, %d);\n", next);
+        break;
+    case OP_SUBTRACT_CONSTANT:
+        fprintf(out, "AOT_CONSTANT(%d);\n    AOT_BINARY(NUMBER_VAL, -, %d);\n", ip[1], next);
+        break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+        fprintf(out, "AOT_BINARY(NUMBER_VAL, *, %d);\n", next);
+        break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+        fprintf(out, "AOT_BINARY(NUMBER_VAL, /, %d);\n", next);
+        break;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+        fprintf(out, "AOT_BINARY(BOOL_VAL, >, %d);\n", next);
+        break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+        fprintf(out, "AOT_BINARY(BOOL_VAL, <, %d);\n", next);
+        break;
+    case OP_LESS_CONSTANT:
+        fprintf(out, "AOT_CONSTANT(%d);\n    AOT_BINARY(BOOL_VAL, <, %d);\n", ip[1], next);
+        break;
+    case OP_NEGATE:
+        fprintf(out, "AOT_NEGATE(%d);\n", next);
+        break;
+    case OP_NOT:
+        fprintf(out, "AOT_NOT();\n");
+        break;
+    case OP_EQUAL:
+        fprintf(out, "AOT_EQUAL();\n");
+        break;
+    case OP_PRINT:
+        fprintf(out, "AOT_PRINT();\n");
+        break;
+    case OP_JUMP:
+    case OP_LOOP:
+        fprintf(out, "goto L%d;\n", jumpTarget(chunk, offset));
+        break;
+    case OP_JUMP_IF_FALSE:
+        fprintf(out, "if (AOT_FALSEY(sp[-1])) goto L%d;\n", jumpTarget(chunk, offset));
+        break;
+    case OP_POP_JUMP_IF_FALSE:
+        fprintf(out, "AOT_POP();\n    if (AOT_FALSEY(sp[0])) goto L%d;\n", jumpTarget(chunk, offset));
+        break;
+    case OP_CALL:
+        fprintf(out, "AOT_RUNTIME(%d, aotCall(%d));\n", next, ip[1]);
+        break;
+    case OP_TAIL_CALL:
+        fprintf(out, "AOT_TAIL_CALL(%d, %d);\n", ip[1], next);
+        break;
+    case OP_RETURN:
+        fprintf(out, "AOT_RETURN();\n");
+        break;
+    case OP_CLOSURE:
+        fprintf(out, "AOT_SPILLED(%d, aotClosure(AS_FUNCTION(constants[%d]), code + %d));\n", next, ip[1],
+                offset + 2);
+        break;
+    case OP_CLASS:
+        fprintf(out, "AOT_SPILLED(%d, aotClass(AOT_STRING(%d)));\n", next, ip[1]);
+        break;
+    case OP_METHOD:
+        fprintf(out, "AOT_SPILLED(%d, aotMethod(AOT_STRING(%d)));\n", next, ip[1]);
+        break;
+    case OP_INHERIT:
+        fprintf(out, "AOT_RUNTIME(%d, aotInherit());\n", next);
+        break;
+    case OP_GET_PROPERTY:
+        fprintf(out, "AOT_RUNTIME(%d, aotGetProperty(AOT_STRING(%d), &caches[%d]));\n", next, ip[1],
+                ip[2] << 8 | ip[3]);
+        break;
+    case OP_SET_PROPERTY:
+        fprintf(out, "AOT_RUNTIME(%d, aotSetProperty(AOT_STRING(%d), &caches[%d]));\n", next, ip[1],
+                ip[2] << 8 | ip[3]);
+        break;
+    case OP_GET_SUPER:
+        fprintf(out, "AOT_RUNTIME(%d, aotGetSuper(AOT_STRING(%d), &caches[%d]));\n", next, ip[1],
+                ip[2] << 8 | ip[3]);
+        break;
+    case OP_INVOKE:
+        fprintf(out, "AOT_RUNTIME(%d, aotInvoke(AOT_STRING(%d), %d, &caches[%d]));\n", next, ip[1], ip[2],
+                ip[3] << 8 | ip[4]);
+        break;
+    case OP_SUPER_INVOKE:
+        fprintf(out, "AOT_RUNTIME(%d, aotSuperInvoke(AOT_STRING(%d), %d, &caches[%d]));\n", next, ip[1], ip[2],
+                ip[3] << 8 | ip[4]);
+        break;
+    default:
+        fprintf(out, "#error unknown opcode %d\n", ip[0]);
+        break;
+    }
+    return next;
+}
+
+/// writes the C function of a Lox function: its instructions in order, with a label on each jump target
+/// @param out      the C file
+/// @param function the function
+/// @param index    its number, the C function is function<index>
+static void emitFunction(FILE* out, ObjFunction* function, int index)
+{
+    Chunk* chunk = &function->chunk;
+    bool* targets = calloc(chunk->count + 1, sizeof(bool));
+    if (targets == NULL) exit(1);
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        int target = jumpTarget(chunk, offset);
+        if (target != -1) targets[target] = true;
+    }
+
+    fprintf(out, "\n// %s\nstatic CompiledStatus function%d(void)\n{\n    AOT_PROLOGUE();\n",
+            function->name == NULL ? "script" : function->name->chars, index);
+    int line = -1;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        if (chunk->lines[offset] != line)
+        {
+            line = chunk->lines[offset];
+            fprintf(out, "    // line %d\n", line);
+        }
+        if (targets[offset]) fprintf(out, "L%d:\n", offset);
+        offset = emitInstruction(out, chunk, offset);
+    }
+    fprintf(out, "}\n");
+    free(targets);
+}
+
+/// writes a string as a C string literal, a line of the string per line of C
+/// @param out  the C file
+/// @param text the string
+static void emitStringLiteral(FILE* out, const char* text)
+{
+    fprintf(out, "    \"");
+    for (const char* c = text; *c != '\0'; c++)
+    {
+        switch (*c)
+        {
+        case '\n':
+            fprintf(out, c[1] == '\0' ? "\\n" : "\\n\"\n    \"");
+            break;
+        case '\\':
+        case '"':
+        case '?':
+            fprintf(out, "\\%c", *c);
+            break;
+        default:
+            if (*c >= ' ' && *c < 127) fputc(*c, out);
+            else fprintf(out, "\\%03o", (unsigned char)*c);
+            break;
+        }
+    }
+    fprintf(out, "\"");
+}
+
+/// translates a script to a C program: one C function per Lox function, running the function's instructions in order
+/// on the VM's stack with a goto for every jump. the program links against the runtime (every source but main.c),
+/// compiles the script again when it starts to get the same constants and runs each function's C body in place of
+/// its bytecode
+/// @param source the script's source
+/// @param out    the file the program is written to
+/// @return       false if the script doesn't compile
+bool emitC(const char* source, FILE* out)
+{
+    ObjFunction* script = compile(source);
+    if (script == NULL) return false;
+
+    FunctionList list = {0};
+    listFunctions(&list, script);
+
+    fprintf(out, "// generated by clox --emit-c, link it against the clox runtime\n#include \"aot.h\"\n\n");
+    fprintf(out, "static const char source[] =\n");
+    emitStringLiteral(out, source);
+    fprintf(out, ";\n\n");
+
+    for (int i = 0; i < list.count; i++) fprintf(out, "static CompiledStatus function%d(void);\n", i);
+    for (int i = 0; i < list.count; i++) emitFunction(out, list.functions[i], i);
+
+    fprintf(out, "\nstatic const CompiledFn bodies[] = {");
+    for (int i = 0; i < list.count; i++) fprintf(out, "%sfunction%d", i == 0 ? "" : ", ", i);
+    fprintf(out, "};\nstatic const int sizes[] = {");
+    for (int i = 0; i < list.count; i++) fprintf(out, "%s%d", i == 0 ? "" : ", ", list.functions[i]->chunk.count);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "int main(void)\n{\n"
+                 "    initVM();\n"
+                 "    InterpretResult result = interpretCompiled(source, bodies, sizes, %d);\n"
+                 "    freeVM();\n"
+                 "    return result == INTERPRET_COMPILE_ERROR ? 65 : result == INTERPRET_RUNTIME_ERROR ? 70 : 0;\n"
+                 "}\n", list.count);
+
+    free(list.functions);
+    return true;
+}
+
+#ifdef CLOX_AOT_THREAD
+/// the body of the script's thread
+/// @param called where the thread stores whether the script ran without a runtime error
+static void* scriptThread(void* called)
+{
+    *(bool*)called = aotCall(0);
+    return NULL;
+}
+#endif
+
+/// calls the script's closure on top of the stack. compiled calls nest on the C stack, so where threads are available
+/// the script runs on one whose stack fits FRAMES_MAX of them
+/// @return false after a runtime error
+static bool runScript()
+{
+#ifdef CLOX_AOT_THREAD
+    pthread_attr_t attributes;
+    if (pthread_attr_init(&attributes) == 0)
+    {
+        bool called = false;
+        pthread_t thread;
+        bool started = pthread_attr_setstacksize(&attributes, (size_t)FRAMES_MAX * AOT_FRAME_STACK) == 0 &&
+            pthread_create(&thread, &attributes, scriptThread, &called) == 0;
+        pthread_attr_destroy(&attributes);
+        if (started)
+        {
+            pthread_join(thread, NULL);
+            return called;
+        }
+    }
+#endif
+    return aotCall(0);
+}
+
+/// runs a program built by --emit-c. the source is compiled again, which gives the functions the C was emitted from,
+/// and each of them gets its C body
+/// @param source the script's source
+/// @param bodies the C bodies, numbered like listFunctions() numbers the functions
+/// @param sizes  the bytecode size of each function when the C was emitted, a different compiler gives other sizes
+/// @param count  the number of functions
+/// @return       the result of the run
+InterpretResult interpretCompiled(const char* source, const CompiledFn* bodies, const int* sizes, int count)
+{
+    ObjFunction* function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+    FunctionList list = {0};
+    listFunctions(&list, function);
+    bool matches = list.count == count;
+    for (int i = 0; matches && i < count; i++) matches = list.functions[i]->chunk.count == sizes[i];
+    for (int i = 0; matches && i < count; i++) list.functions[i]->compiled = bodies[i];
+    free(list.functions);
+    if (!matches)
+    {
+        fprintf(stderr, "The program was generated by a different version of clox.\n");
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    push(OBJ_VAL(function));
+    ObjClosure* closure = newClosure(function);
+    pop();
+    push(OBJ_VAL(closure));
+    return runScript() ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+}
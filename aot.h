@@ -0,0 +1,158 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include <stdio.h>
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// the most C stack one call of compiled code takes (the function's body and the runtime calls between it and its
+// caller), the script runs on a thread with room for FRAMES_MAX of them
+#define AOT_FRAME_STACK 512
+
+bool emitC(const char* source, FILE* out);
+
+InterpretResult interpretCompiled(const char* source, const CompiledFn* bodies, const int* sizes, int count);
+
+// the runtime of the generated code, see vm.c. they work on the spilled stack of the top frame
+bool aotCall(int argCount);
+
+CompiledStatus aotTailCall(int argCount);
+
+bool aotInvoke(ObjString* name, int argCount, InlineCache* cache);
+
+bool aotSuperInvoke(ObjString* name, int argCount, InlineCache* cache);
+
+bool aotGetProperty(ObjString* name, InlineCache* cache);
+
+bool aotSetProperty(ObjString* name, InlineCache* cache);
+
+bool aotGetSuper(ObjString* name, InlineCache* cache);
+
+void aotClosure(ObjFunction* function, uint8_t* upvalues);
+
+void aotCloseUpvalues(Value* last);
+
+void aotClass(ObjString* name);
+
+void aotMethod(ObjString* name);
+
+bool aotInherit();
+
+bool aotAdd();
+
+CompiledStatus aotError(const char* message);
+
+CompiledStatus aotUndefinedVariable(int slot);
+
+// the instructions of a compiled function. every body starts with AOT_PROLOGUE(), which keeps the stack top in sp. the
+// instructions that can call, allocate or fail take the offset of the next instruction: they spill sp and point the
+// frame's ip there first, which is what stack traces and the GC go by, and reload the stack afterward
+#define AOT_PROLOGUE() \
+int frameIndex = vm.frameCount - 1; \
+ObjClosure* closure = vm.frames[frameIndex].closure; \
+Value* constants = closure->function->chunk.constants.values; \
+InlineCache* caches = closure->function->chunk.caches; \
+uint8_t* code = closure->function->chunk.code; \
+Value* slots = vm.frames[frameIndex].slots; \
+Value* sp = vm.stackTop; \
+(void)constants; \
+(void)caches; \
+(void)code
+
+#define AOT_SPILL(next) (vm.frames[frameIndex].ip = code + (next), vm.stackTop = sp)
+#define AOT_RELOAD() (sp = vm.stackTop, slots = vm.frames[frameIndex].slots)
+#define AOT_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+#define AOT_STRING(index) AS_STRING(constants[index])
+
+// runs a runtime call on the spilled stack, AOT_RUNTIME() for the ones that can fail
+#define AOT_SPILLED(next, call) (AOT_SPILL(next), (call), AOT_RELOAD())
+#define AOT_RUNTIME(next, call) \
+do { \
+AOT_SPILL(next); \
+if (!(call)) return COMPILED_ERROR; \
+AOT_RELOAD(); \
+} while (false)
+
+#define AOT_CONSTANT(index) (*sp++ = constants[index])
+#define AOT_NIL() (*sp++ = NIL_VAL)
+#define AOT_TRUE() (*sp++ = BOOL_VAL(true))
+#define AOT_FALSE() (*sp++ = BOOL_VAL(false))
+#define AOT_POP() (sp--)
+#define AOT_GET_LOCAL(slot) (*sp++ = slots[slot])
+#define AOT_SET_LOCAL(slot) (slots[slot] = sp[-1])
+#define AOT_GET_UPVALUE(slot) (*sp++ = *closure->upvalues[slot]->location)
+#define AOT_SET_UPVALUE(slot) (*closure->upvalues[slot]->location = sp[-1])
+#define AOT_CLOSE_UPVALUE() (aotCloseUpvalues(sp - 1), sp--)
+#define AOT_DEFINE_GLOBAL(slot) (vm.globalValues.values[slot] = *--sp)
+#define AOT_PRINT() (printValue(*--sp), printf("\n"))
+#define AOT_NOT() (sp[-1] = BOOL_VAL(AOT_FALSEY(sp[-1])))
+#define AOT_EQUAL() (sp--, sp[-1] = BOOL_VAL(valuesEqual(sp[-1], sp[0])))
+
+#define AOT_GET_GLOBAL(slot, next) \
+do { \
+Value value = vm.globalValues.values[slot]; \
+if (IS_UNDEFINED(value)) { \
+AOT_SPILL(next); \
+return aotUndefinedVariable(slot); \
+} \
+*sp++ = value; \
+} while (false)
+
+#define AOT_SET_GLOBAL(slot, next) \
+do { \
+if (IS_UNDEFINED(vm.globalValues.values[slot])) { \
+AOT_SPILL(next); \
+return aotUndefinedVariable(slot); \
+} \
+vm.globalValues.values[slot] = sp[-1]; \
+} while (false)
+
+#define AOT_NEGATE(next) \
+do { \
+if (!IS_NUMBER(sp[-1])) { \
+AOT_SPILL(next); \
+return aotError("Operand must be a number."); \
+} \
+sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1])); \
+} while (false)
+
+#define AOT_BINARY(valueType, op, next) \
+do { \
+if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) { \
+AOT_SPILL(next); \
+return aotError("Operands must be numbers."); \
+} \
+sp--; \
+sp[-1] = valueType(AS_NUMBER(sp[-1]) op AS_NUMBER(sp[0])); \
+} while (false)
+
+#define AOT_ADD(next) \
+do { \
+if (IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) { \
+sp--; \
+sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1]) + AS_NUMBER(sp[0])); \
+} else { \
+AOT_RUNTIME(next, aotAdd()); \
+} \
+} while (false)
+
+#define AOT_TAIL_CALL(argCount, next) \
+do { \
+AOT_SPILL(next); \
+CompiledStatus status = aotTailCall(argCount); \
+if (status != COMPILED_RETURN) return status; \
+AOT_RELOAD(); \
+} while (false)
+
+#define AOT_RETURN() \
+do { \
+Value result = sp[-1]; \
+aotCloseUpvalues(slots); \
+vm.frameCount--; \
+vm.stackTop = slots; \
+if (vm.frameCount > 0) *vm.stackTop++ = result; \
+return COMPILED_RETURN; \
+} while (false)
+
+#endif //CLOX_AOT_H
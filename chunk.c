@@ -15,6 +15,13 @@ void initChunk(Chunk* chunk)
     chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->mapped = false;
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->loops = NULL;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
 }
 
 /// @brief writes a value to a chunk
@@ -42,9 +49,14 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
 /// @param chunk    a pointer to the chunk that needs to be freed
 void freeChunk(Chunk* chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->count);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (!chunk->mapped)
+    {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->count);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    FREE_ARRAY(LoopCounter, chunk->loops, chunk->loopCapacity);
     initChunk(chunk);
 }
 
@@ -58,4 +70,38 @@ int addConstant(Chunk* chunk, Value value)
     writeValueArray(&chunk->constants, value);
     pop();
     return chunk->constants.count - 1;
+}
+
+/// adds an empty inline cache for a property instruction
+/// @param chunk    a pointer to the chunk
+/// @returns        the index of the new cache
+int addCache(Chunk* chunk)
+{
+    if (chunk->cacheCapacity < chunk->cacheCount + 1)
+    {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->count = 0;
+    cache->megamorphic = false;
+    return chunk->cacheCount++;
+}
+
+/// adds a zeroed back-edge counter for an OP_LOOP
+/// @param chunk    a pointer to the chunk
+/// @returns        the index of the new counter
+int addLoop(Chunk* chunk)
+{
+    if (chunk->loopCapacity < chunk->loopCount + 1)
+    {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->loops = GROW_ARRAY(LoopCounter, chunk->loops, oldCapacity, chunk->loopCapacity);
+    }
+
+    chunk->loops[chunk->loopCount] = (LoopCounter){0, 0, NULL};
+    return chunk->loopCount++;
 }
\ No newline at end of file
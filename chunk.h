@@ -16,10 +16,10 @@ typedef enum
     OP_FALSE,
     OP_POP,
     OP_GET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
+    OP_GET_GLOBAL, // 16-bit global slot
+    OP_DEFINE_GLOBAL, // 16-bit global slot
     OP_SET_LOCAL,
-    OP_SET_GLOBAL,
+    OP_SET_GLOBAL, // 16-bit global slot
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -32,21 +32,75 @@ typedef enum
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
-    OP_LOOP,
+    OP_LOOP, // 16-bit offset back, 16-bit loop counter index
     OP_CLOSURE,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
+    OP_GET_PROPERTY, // name, 16-bit cache index
+    OP_SET_PROPERTY, // name, 16-bit cache index
     OP_CLOSE_UPVALUE,
     OP_CLASS,
     OP_METHOD,
-    OP_INVOKE,
+    OP_INVOKE, // name, argument count, 16-bit cache index
     OP_INHERIT,
-    OP_GET_SUPER,
-    OP_SUPER_INVOKE,
+    OP_GET_SUPER, // name, 16-bit cache index
+    OP_SUPER_INVOKE, // name, argument count, 16-bit cache index
+    OP_TAIL_CALL, // argument count, a call whose result is returned right away, reuses the caller's frame
+
+    // superinstructions, each one replaces a sequence the compiler emits in hot loops
+    OP_ADD_LOCALS, // GET_LOCAL a; GET_LOCAL b; ADD
+    OP_ADD_CONSTANT, // CONSTANT k; ADD
+    OP_SUBTRACT_CONSTANT, // CONSTANT k; SUBTRACT
+    OP_LESS_CONSTANT, // CONSTANT k; LESS
+    OP_SET_LOCAL_POP, // SET_LOCAL a; POP
+    OP_POP_JUMP_IF_FALSE, // JUMP_IF_FALSE; POP on both paths
+
+    // quickened instructions, the VM rewrites the generic opcode to one of these after seeing its operand types
+    // and rewrites it back when the guard fails. the compiler never emits them.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
 } OpCode;
 
+// the number of receiver shapes an inline cache holds before it gives up and goes megamorphic
+#define CACHE_WAYS 4
+
+struct ObjShape;
+
+// an inline cache entry, the result of resolving a property for receivers of one shape
+typedef struct
+{
+    struct ObjShape* shape;      // the receiver shape, shapes belong to a single class
+    struct ObjShape* transition; // OP_SET_PROPERTY only: the shape after adding the field, NULL if the field existed
+    int slot;                    // the field slot, -1 if the property is a method
+    Value method;
+    int version;                 // the version of the class's method table the entry was filled with
+} CacheEntry;
+
+// the inline cache of a single property, invoke or super instruction, found through the instruction's cache operand.
+// a cache is monomorphic with one entry, polymorphic with up to CACHE_WAYS, and stops caching once megamorphic.
+typedef struct
+{
+    CacheEntry entries[CACHE_WAYS];
+    int count;
+    bool megamorphic;
+} InlineCache;
+
+struct JitTrace;
+
+// the back-edge counter of a single OP_LOOP, found through the instruction's counter operand. once the loop is hot
+// the JIT records a trace of its body and compiles it
+typedef struct
+{
+    int count;
+    int recordings;        // the traces recorded for the loop so far
+    struct JitTrace* trace; // the compiled trace, NULL until there is one
+} LoopCounter;
+
 //wrapper around an array of bytes
 typedef struct
 {
@@ -58,6 +112,15 @@ typedef struct
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    bool mapped; // code and lines point into a mapped .loxc file, which owns them
+
+    InlineCache* caches;
+    int cacheCount;
+    int cacheCapacity;
+
+    LoopCounter* loops;
+    int loopCount;
+    int loopCapacity;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -68,4 +131,8 @@ void freeChunk(Chunk* chunk);
 
 int addConstant(Chunk* chunk, Value value);
 
+int addCache(Chunk* chunk);
+
+int addLoop(Chunk* chunk);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+# translates each of SCRIPTS with CLOX --emit-c, builds the C with CC against RUNTIME in WORK, and fails on the first
+# script whose program prints or exits differently from CLOX --no-jit
+file(MAKE_DIRECTORY ${WORK})
+foreach (script IN LISTS SCRIPTS)
+    get_filename_component(name ${script} NAME_WE)
+    execute_process(COMMAND ${CLOX} --emit-c ${script} ${WORK}/${name}.c RESULT_VARIABLE emitResult)
+    if (NOT emitResult EQUAL 0)
+        message(FATAL_ERROR "${script}: --emit-c failed (exit ${emitResult})")
+    endif ()
+
+    execute_process(COMMAND ${CC} -O2 -I${INCLUDE} ${WORK}/${name}.c ${RUNTIME} -lm -lpthread -o ${WORK}/${name}
+        ERROR_VARIABLE buildErrors RESULT_VARIABLE buildResult)
+    if (NOT buildResult EQUAL 0)
+        message(FATAL_ERROR "${script}: the generated C doesn't build\n${buildErrors}")
+    endif ()
+
+    execute_process(COMMAND ${CLOX} --no-jit ${script}
+        OUTPUT_VARIABLE interpreted ERROR_VARIABLE interpretedErrors RESULT_VARIABLE interpretedResult)
+    execute_process(COMMAND ${WORK}/${name}
+        OUTPUT_VARIABLE compiled ERROR_VARIABLE compiledErrors RESULT_VARIABLE compiledResult)
+
+    if (NOT interpreted STREQUAL compiled OR NOT interpretedErrors STREQUAL compiledErrors
+        OR NOT interpretedResult STREQUAL compiledResult)
+        message(FATAL_ERROR "${script}: the compiled program differs from the interpreter\n"
+            "--no-jit (exit ${interpretedResult}):\n${interpreted}${interpretedErrors}\n"
+            "--emit-c (exit ${compiledResult}):\n${compiled}${compiledErrors}")
+    endif ()
+    message(STATUS "${script}: same output both ways")
+endforeach ()
@@ -0,0 +1,16 @@
+# runs each of SCRIPTS with CLOX twice, interpreted (--no-jit) and with every function compiled on its first call
+# (--jit-eager), and fails on the first script whose output or exit code differ between the two
+foreach (script IN LISTS SCRIPTS)
+    execute_process(COMMAND ${CLOX} --no-jit ${script}
+        OUTPUT_VARIABLE interpreted ERROR_VARIABLE interpretedErrors RESULT_VARIABLE interpretedResult)
+    execute_process(COMMAND ${CLOX} --jit-eager ${script}
+        OUTPUT_VARIABLE compiled ERROR_VARIABLE compiledErrors RESULT_VARIABLE compiledResult)
+
+    if (NOT interpreted STREQUAL compiled OR NOT interpretedErrors STREQUAL compiledErrors
+        OR NOT interpretedResult STREQUAL compiledResult)
+        message(FATAL_ERROR "${script}: the JIT differs from the interpreter\n"
+            "--no-jit (exit ${interpretedResult}):\n${interpreted}${interpretedErrors}\n"
+            "--jit-eager (exit ${compiledResult}):\n${compiled}${compiledErrors}")
+    endif ()
+    message(STATUS "${script}: same output both ways")
+endforeach ()
@@ -18,6 +18,32 @@
 // a flag for the allowing of NaN Boxing
 #define NAN_BOXING
 
+// threaded dispatch (set by the CLOX_COMPUTED_GOTO CMake option) needs the labels-as-values extension,
+// compilers without it fall back to the portable switch
+#if defined(CLOX_COMPUTED_GOTO) && !defined(__GNUC__)
+#undef CLOX_COMPUTED_GOTO
+#endif
+
+// the VM's stacks are mapped with a guard page on POSIX systems, elsewhere they are plain heap blocks
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_MMAP_STACKS
+#endif
+
+// scripts are cached as .loxc files next to their source and mapped back in on POSIX systems
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_BYTECODE_CACHE
+#endif
+
+// programs built by --emit-c nest their calls on the C stack, POSIX systems run them on a thread with a large one
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_AOT_THREAD
+#endif
+
+// the JIT (set by the CLOX_JIT CMake option) emits x86-64 code for the System V ABI that works on NaN-boxed values
+#if defined(CLOX_JIT) && !(defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING))
+#undef CLOX_JIT
+#endif
+
 #define UINT24_MAX 0x00ffffff
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -84,6 +84,9 @@ typedef struct Compiler
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int lastInstruction; // offset of the last emitted instruction, -1 if unknown
+    int previousInstruction; // offset of the instruction before it, -1 if unknown
+    int lastJumpTarget; // the highest offset a jump can land on, instructions are never fused across it
 } Compiler;
 
 // a struct for a linked list of class compilers
@@ -212,28 +215,110 @@ static void emitByte(uint8_t byte)
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
+/// appends an opcode to the chunk and records where the instruction starts for the superinstruction peephole
+/// @param op the opcode byte
+static void emitOp(uint8_t op)
+{
+    current->previousInstruction = current->lastInstruction;
+    current->lastInstruction = currentChunk()->count;
+    emitByte(op);
+}
+
 /// a function that writes 2 bytes at once for ease of implementation
 /// @param byte1 the opcode byte
 /// @param byte2 the operand byte
 static void emitBytes(uint8_t byte1, uint8_t byte2)
 {
-    emitByte(byte1);
+    emitOp(byte1);
     emitByte(byte2);
 }
 
+/// records that a jump lands on the next emitted instruction, so it won't be fused with the ones before it
+/// @return the offset of the jump target
+static int markJumpTarget()
+{
+    current->lastJumpTarget = currentChunk()->count;
+    return current->lastJumpTarget;
+}
+
+/// checks if the last emitted instruction is the given one and nothing jumps into the middle of a fusion with it
+/// @param op     the opcode to look for
+/// @param length the length of the instruction in bytes
+/// @return       true if the last instruction can be fused with the next one
+static bool lastInstructionIs(OpCode op, int length)
+{
+    int offset = current->lastInstruction;
+    return offset >= current->lastJumpTarget && offset + length == currentChunk()->count &&
+        currentChunk()->code[offset] == op;
+}
+
+/// emits an arithmetic or comparison instruction, fusing it with a constant right operand when there is one
+/// @param op         the generic opcode
+/// @param constantOp the superinstruction that takes the right operand from the constant pool
+static void emitBinaryOp(OpCode op, OpCode constantOp)
+{
+    // CONSTANT k; op -> constantOp k, the fused instruction has the same length so it is rewritten in place
+    if (lastInstructionIs(OP_CONSTANT, 2))
+    {
+        currentChunk()->code[current->lastInstruction] = constantOp;
+        return;
+    }
+
+    emitOp(op);
+}
+
+/// emits an OP_ADD, fusing GET_LOCAL a; GET_LOCAL b; ADD into ADD_LOCALS a b and CONSTANT k; ADD into ADD_CONSTANT k
+static void emitAdd()
+{
+    int previous = current->previousInstruction;
+    if (lastInstructionIs(OP_GET_LOCAL, 2) && previous >= current->lastJumpTarget && previous + 2 == current->lastInstruction
+        && currentChunk()->code[previous] == OP_GET_LOCAL)
+    {
+        uint8_t a = currentChunk()->code[previous + 1];
+        uint8_t b = currentChunk()->code[previous + 3];
+
+        // drops both loads and emits the fused instruction in their place
+        currentChunk()->count = previous;
+        current->lastInstruction = current->previousInstruction = -1;
+        emitBytes(OP_ADD_LOCALS, a);
+        emitByte(b);
+        return;
+    }
+
+    emitBinaryOp(OP_ADD, OP_ADD_CONSTANT);
+}
+
+/// emits an OP_POP, fusing SET_LOCAL; POP into SET_LOCAL_POP
+static void emitPop()
+{
+    if (lastInstructionIs(OP_SET_LOCAL, 2))
+    {
+        currentChunk()->code[current->lastInstruction] = OP_SET_LOCAL_POP;
+        return;
+    }
+
+    emitOp(OP_POP);
+}
+
 /// a helper function to emit the loop bytecode
 /// @param loopStart the start index for the loop block
 static void emitLoop(int loopStart)
 {
-    emitByte(OP_LOOP);
+    emitOp(OP_LOOP);
 
-    // Calculate the offset for the jump (distance back to loopStart).
-    int offset = currentChunk()->count - loopStart + 2;
+    // Calculate the offset for the jump (distance back to loopStart, past both operands).
+    int offset = currentChunk()->count - loopStart + 4;
     // Ensure the loop body isn't too large to fit in a 16-bit jump offset.
     if (offset > UINT16_MAX) error("Loop body too large");
 
     emitByte((offset >> 8) & 0xFF);
     emitByte(offset & 0xFF);
+
+    // the loop's back-edge counter
+    int loop = addLoop(currentChunk());
+    if (loop > UINT16_MAX) error("Too many loops in one function.");
+    emitByte((loop >> 8) & 0xff);
+    emitByte(loop & 0xff);
 }
 
 /// the function emits a jump instruction to the bytecode with filler operands and returns the filler index
@@ -241,7 +326,7 @@ static void emitLoop(int loopStart)
 /// @return             the index for the jump operands
 static int emitJump(uint8_t instruction)
 {
-    emitByte(instruction);
+    emitOp(instruction);
     emitByte(0xff);
     emitByte(0xff);
     return currentChunk()->count - 2;
@@ -257,9 +342,9 @@ static void emitReturn()
     }
     else //else, returns default return value for functions without an explicit return.
     {
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
     }
-    emitByte(OP_RETURN);
+    emitOp(OP_RETURN);
 }
 
 /// a function to emit the constant value to the chunk
@@ -278,6 +363,21 @@ static uint32_t makeConstant(Value value)
     return (uint32_t)constant;
 }
 
+/// adds an inline cache to the chunk and emits its 16-bit index as the operand of a property, invoke or super
+/// instruction
+static void emitCache()
+{
+    int cache = addCache(currentChunk());
+
+    if (cache > UINT16_MAX)
+    {
+        error("Too many property accesses in one function.");
+    }
+
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
+}
+
 /// emits the constant byteCode to the chunk using the writeConstant function because of extended functionality
 /// @param value the value that needs appending
 static void emitConstant(Value value)
@@ -294,7 +394,8 @@ static void emitConstant(Value value)
         //writes the instruction opcode to the chunk
         //splits the constant index into 3 bytes and writes them in a little endian style
         emitBytes(OP_CONSTANT_LONG, (uint8_t)constant);
-        emitBytes((uint8_t)(constant >> 8), (uint8_t)(constant >> 16));
+        emitByte((uint8_t)(constant >> 8));
+        emitByte((uint8_t)(constant >> 16));
     }
 }
 
@@ -314,6 +415,9 @@ static void patchJump(int offset)
     // Store the jump offset in the bytecode at the given offset position.
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+
+    // the next instruction is a jump target now
+    markJumpTarget();
 }
 
 /// gets a compiler struct and initializes it
@@ -328,6 +432,9 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastInstruction = -1;
+    compiler->previousInstruction = -1;
+    compiler->lastJumpTarget = 0;
     compiler->function = newFunction();
 
     //set the current compiler to this one
@@ -392,11 +499,11 @@ static void endScope()
     {
         if (current->locals[current->localCount - 1].isCaptured)
         {
-            emitByte(OP_CLOSE_UPVALUE);
+            emitOp(OP_CLOSE_UPVALUE);
         }
         else
         {
-            emitByte(OP_POP);
+            emitOp(OP_POP);
         }
         current->localCount--;
     }
@@ -424,7 +531,7 @@ static void or_(bool canAssign)
     int endJump = emitJump(OP_JUMP);
 
     patchJump(elseJump);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     parsePrecedence(PREC_OR);
     patchJump(endJump);
@@ -486,6 +593,32 @@ static uint8_t identifierConstant(Token* name)
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+/// returns the global slot of an identifier, the VM hands out slots by name so every function sees the same one
+/// @param name a pointer to a token that represents the identifier
+/// @return     the index of the variable in the VM's global array
+static uint16_t globalSlotFor(Token* name)
+{
+    int slot = globalSlot(copyString(name->start, name->length));
+
+    if (slot > UINT16_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
+/// emits a global variable instruction with its 16-bit slot operand
+/// @param op   the global instruction
+/// @param slot the slot of the variable
+static void emitGlobal(uint8_t op, uint16_t slot)
+{
+    emitOp(op);
+    emitByte((slot >> 8) & 0xff);
+    emitByte(slot & 0xff);
+}
+
 /// adds the variable to the local variable pool in the compiler
 /// @param name the name of the variable
 static void addLocal(Token name)
@@ -639,6 +772,7 @@ static void namedVariable(Token name, bool canAssign)
 {
     //checks if the variable in question is a local or global variable and sets the opcodes accordingly
     uint8_t getOp, setOp;
+    bool global = false;
 
     // Check if the variable is a local variable.
     int arg = resolveLocal(current, &name);
@@ -656,20 +790,28 @@ static void namedVariable(Token name, bool canAssign)
     // If not found locally or as an upvalue, assume it's a global variable.
     else
     {
-        arg = identifierConstant(&name);
+        arg = globalSlotFor(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        global = true;
     }
 
     //if there is an equals sign after the identifier we compile the assigned value
+    uint8_t op = getOp;
     if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        op = setOp;
+    }
+
+    //globals take a 16-bit slot, locals and upvalues a single byte
+    if (global)
+    {
+        emitGlobal(op, (uint16_t)arg);
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        emitBytes(op, (uint8_t)arg);
     }
 }
 
@@ -743,11 +885,13 @@ static void super_(bool canAssign)
         namedVariable(syntheticToken("super"), false);
         emitBytes(OP_SUPER_INVOKE,name);
         emitByte(argCount);
+        emitCache();
     }
     else
     {
         namedVariable(syntheticToken("super"), false);
         emitBytes(OP_GET_SUPER, name);
+        emitCache();
     }
 }
 
@@ -765,9 +909,9 @@ static void this_(bool canAssign)
 }
 
 /// parse a variable identifier from the token stream
-/// @param errorMessage the message we want to print if the identifier is not found
+/// @return             the global slot of the variable, 0 for locals
 /// @return             the index of the constant in the constant table
-static uint8_t parseVariable(const char* errorMessage)
+static uint16_t parseVariable(const char* errorMessage)
 {
     //consumes the identifier token
     consume(TOKEN_IDENTIFIER, errorMessage);
@@ -776,8 +920,8 @@ static uint8_t parseVariable(const char* errorMessage)
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    //add the variable to the constant array
-    return identifierConstant(&parser.previous);
+    //look up the variable's global slot
+    return globalSlotFor(&parser.previous);
 }
 
 /// a helper function to mark a local variable as initialized at the end of the initialization.
@@ -789,7 +933,7 @@ static void markInitialized()
 }
 
 ///defines a global variable in the bytecode
-static void defineVariable(uint8_t global)
+static void defineVariable(uint16_t global)
 {
     //if the variable is local, leave the function
     if (current->scopeDepth > 0)
@@ -799,7 +943,7 @@ static void defineVariable(uint8_t global)
     }
 
     //emits the global variable to the bytecode
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 /// a parser function for and operator
@@ -808,7 +952,7 @@ static void and_(bool canAssign)
 {
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     parsePrecedence(PREC_AND);
 
     patchJump(endJump);
@@ -825,34 +969,37 @@ static void binary(bool canAssign)
     switch (operatorType)
     {
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        emitAdd();
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        emitBinaryOp(OP_SUBTRACT, OP_SUBTRACT_CONSTANT);
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        emitOp(OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        emitOp(OP_DIVIDE);
         break;
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitOp(OP_EQUAL);
+        emitOp(OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        emitOp(OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        emitOp(OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        emitBinaryOp(OP_LESS, OP_LESS_CONSTANT);
+        emitOp(OP_NOT);
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        emitBinaryOp(OP_LESS, OP_LESS_CONSTANT);
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        emitOp(OP_GREATER);
+        emitOp(OP_NOT);
         break;
     default:
         return; //Unreachable
@@ -881,6 +1028,7 @@ static void dot(bool canAssign)
     {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitCache();
     }
     // If the next token is a left parenthesis, then it is a function call
     else if (match(TOKEN_LEFT_PAREN))
@@ -888,11 +1036,13 @@ static void dot(bool canAssign)
         uint8_t argCount = argumentList();
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitCache();
     }
     // If neither assignment nor function call, it's a property access.
     else
     {
         emitBytes(OP_GET_PROPERTY, name);
+        emitCache();
     }
 }
 
@@ -903,13 +1053,13 @@ static void literal(bool canAssign)
     switch (parser.previous.type)
     {
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        emitOp(OP_FALSE);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        emitOp(OP_TRUE);
         break;
     case TOKEN_NIL:
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
         break;
     default:
         return;
@@ -959,7 +1109,7 @@ static void function(FunctionType type)
             }
 
             // Parse the parameter name as a variable and define it.
-            uint8_t constant = parseVariable("Expect parameter name.");
+            uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         }
         while (match(TOKEN_COMMA)); // Allow multiple parameters separated by commas.
@@ -1013,7 +1163,7 @@ static void classDeclaration()
     declareVariable();
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalSlotFor(&className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperClass=false;
@@ -1039,7 +1189,7 @@ static void classDeclaration()
 
         //perform the inheritance operation
         namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        emitOp(OP_INHERIT);
         classCompiler.hasSuperClass = true;
     }
 
@@ -1054,7 +1204,7 @@ static void classDeclaration()
 
     //consumes teh right brace at the end of the class definition and declaration
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class name.");
-    emitByte(OP_POP);
+    emitOp(OP_POP);
 
     if (classCompiler.hasSuperClass)
     {
@@ -1069,7 +1219,7 @@ static void classDeclaration()
 static void funDeclaration()
 {
     //parses the function
-    uint8_t global = parseVariable("Except function name.");
+    uint16_t global = parseVariable("Except function name.");
     //mark the function as initialized
     markInitialized();
     function(TYPE_FUNCTION);
@@ -1080,7 +1230,7 @@ static void funDeclaration()
 static void varDeclaration()
 {
     //parses the variable
-    uint8_t global = parseVariable("Expect variable name");
+    uint16_t global = parseVariable("Expect variable name");
 
     //applies the value to the variable if there is one applied upon declaration.
     //else, sets the value to nil
@@ -1090,7 +1240,7 @@ static void varDeclaration()
     }
     else
     {
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
     }
     //consumes the semicolon token at the end of the declaration
     consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration");
@@ -1104,7 +1254,7 @@ static void expressionStatement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' expression.");
-    emitByte(OP_POP);
+    emitPop();
 }
 
 /// compiles the for loop syntax
@@ -1128,7 +1278,7 @@ static void forStatement()
         expressionStatement();
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
 
     int exitJump = -1;
     //the conditional part if present
@@ -1137,18 +1287,17 @@ static void forStatement()
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // pops the condition value
+        // Jump out of the loop if the condition is false, the condition value is popped either way.
+        exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
     }
 
     //the increment part if present
     if (!match(TOKEN_RIGHT_PAREN))
     {
         int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
+        int incrementStart = markJumpTarget();
         expression();
-        emitByte(OP_POP);
+        emitPop();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clause.");
 
         emitLoop(loopStart);
@@ -1163,7 +1312,6 @@ static void forStatement()
     if (exitJump != -1)
     {
         patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
     }
 
     endScope();
@@ -1177,9 +1325,8 @@ static void ifStatement()
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'if'.");
 
-    //calculates the required jump in case of a skip and executes the statement
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    //calculates the required jump in case of a skip and executes the statement, the condition is popped either way
+    int thenJump = emitJump(OP_POP_JUMP_IF_FALSE);
     statement();
 
     //calculates the jump in case the 'else' block needs to be skipped
@@ -1187,7 +1334,6 @@ static void ifStatement()
 
     //sets the jump address after compilation of the "then" block
     patchJump(thenJump);
-    emitByte(OP_POP);
 
     //if an else token exists, compile it
     if (match(TOKEN_ELSE)) statement();
@@ -1200,7 +1346,7 @@ static void printStatement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after statement.");
-    emitByte(OP_PRINT);
+    emitOp(OP_PRINT);
 }
 
 /// compiles the return statement
@@ -1226,25 +1372,30 @@ static void returnStatement()
         //otherwise, compile the return expression
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after return value.");
-        emitByte(OP_RETURN);
+
+        //a call whose result is returned right away becomes a tail call. the return stays for callees that aren't
+        //closures, which the VM calls normally
+        if (lastInstructionIs(OP_CALL, 2))
+        {
+            currentChunk()->code[current->lastInstruction] = OP_TAIL_CALL;
+        }
+        emitOp(OP_RETURN);
     }
 }
 
 /// a function to compile 'while' statements
 static void whileStatement()
 {
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
 }
 
 ///synchronizes the program after encountering a compilation error error
@@ -1355,10 +1506,10 @@ static void unary(bool canAssign)
     switch (operatorType)
     {
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        emitOp(OP_NOT);
         break;
     case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
+        emitOp(OP_NEGATE);
         break;
     default:
         return; //Unreachable.
@@ -2,6 +2,7 @@
 #include "value.h"
 #include <stdio.h>
 #include "object.h"
+#include "vm.h"
 
 /// @brief       disassembles the chunk of instructions one instruction at a time
 /// @param chunk the instruction chunk
@@ -75,10 +76,22 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d", name, offset, offset + 3 + sign * jump);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
+/// prints the debug for OP_LOOP, its jump target and its loop counter
+/// @param chunk  a pointer to the bytecode chunk
+/// @param offset the instruction index
+/// @return       the new instruction index
+static int loopInstruction(Chunk* chunk, int offset)
+{
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8 | chunk->code[offset + 2]);
+    uint16_t loop = (uint16_t)(chunk->code[offset + 3] << 8 | chunk->code[offset + 4]);
+    printf("%-16s %4d -> %d (loop %d)\n", "OP_LOOP", offset, offset + 5 - jump, loop);
+    return offset + 5;
+}
+
 /// prints the debug for a 1 byte constant instruction
 /// @param name   name of the opcode
 /// @param chunk  a pointer to the bytecode chunk
@@ -108,19 +121,62 @@ static int constantLongInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 4;
 }
 
-///
-/// @param name
-/// @param chunk
-/// @param offset
-/// @return
+/// prints the debug for an instruction with two 1 byte operands
+/// @param name   the instruction name
+/// @param chunk  the disassembled chunk
+/// @param offset the bytecode array index
+/// @return       the new offset for the bytecode
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+/// prints the debug for a global variable instruction, the operand is the variable's 16-bit slot
+/// @param name   the instruction name
+/// @param chunk  the disassembled chunk
+/// @param offset the bytecode array index
+/// @return       the new offset for the bytecode
+static int globalInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+/// prints the debug for a property access, a name constant followed by an inline cache index
+/// @param name   the instruction name
+/// @param chunk  the disassembled chunk
+/// @param offset the bytecode array index
+/// @return       the new offset for the bytecode
+static int propertyInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 4;
+}
+
+/// prints the debug for a method invocation
+/// @param name   the instruction name
+/// @param chunk  the disassembled chunk
+/// @param offset the bytecode array index
+/// @return       the new offset for the bytecode
 static int invokeInstruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
-    printf("-%16d (%d args) %4d '", name, argCount, constant);
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;
+    printf("' cache %d\n", cache);
+    return offset + 5;
 }
 
 /// @brief        disassembles the instruction from the bytecode chunk
@@ -177,11 +233,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
     case OP_PRINT:
         return simpleInstruction("OP_PRINT", offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
         return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -191,9 +247,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
     case OP_JUMP_IF_FALSE:
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
-        return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        return loopInstruction(chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_GET_UPVALUE:
         return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
@@ -224,9 +282,9 @@ int disassembleInstruction(Chunk* chunk, int offset)
     case OP_CLASS:
         return constantInstruction("OP_CLASS", chunk, offset);
     case OP_GET_PROPERTY:
-        return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+        return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-        return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+        return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_METHOD:
         return constantInstruction("OP_METHOD", chunk, offset);
     case OP_INVOKE:
@@ -234,9 +292,35 @@ int disassembleInstruction(Chunk* chunk, int offset)
     case OP_INHERIT:
         return simpleInstruction("OP_INHERIT", offset);
     case OP_GET_SUPER:
-        return constantInstruction("OP_GET_SUPER", chunk, offset);
+        return propertyInstruction("OP_GET_SUPER", chunk, offset);
     case OP_SUPER_INVOKE:
         return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_ADD_LOCALS:
+        return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_ADD_CONSTANT:
+        return constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_CONSTANT:
+        return constantInstruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+    case OP_LESS_CONSTANT:
+        return constantInstruction("OP_LESS_CONSTANT", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simpleInstruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+        return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+        return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+        return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -0,0 +1,1150 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef CLOX_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// the x86-64 register numbers
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// the interpreter state the code keeps in callee-saved registers, so helper calls leave it alone.
+// unlike run(), the top of the stack isn't cached: every instruction reads and writes the stack in memory, which is
+// what lets the code be entered or left at any instruction
+#define STACK_REG RBX // the top of the value stack
+#define SLOTS_REG R12 // the frame's slots
+#define FRAME_REG R13 // the CallFrame
+
+// why the code returned to the interpreter
+#define JIT_EXIT 0 // it reached an instruction it leaves to the interpreter
+#define JIT_BAIL 1 // a type guard failed
+
+// the code starts with a prologue that takes the interpreter state and jumps to the instruction to run
+typedef int (*JitEntry)(Value* stackTop, Value* slots, CallFrame* frame, uint8_t* target);
+
+// a rel32 in the code that is patched once the code it jumps to is placed
+typedef struct
+{
+    int at;     // where the rel32 is
+    int offset; // the bytecode offset it jumps to
+    int kind;   // for the jumps to an exit stub, JIT_EXIT or JIT_BAIL
+} Fixup;
+
+typedef struct
+{
+    uint8_t* code;
+    int count;
+    int capacity;
+} Buffer;
+
+// what a trace knows about a value's type
+enum
+{
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+    TYPE_BOOL
+};
+
+typedef struct
+{
+    Buffer buffer;
+    ObjFunction* function;
+    int epilogue;
+    // traces only: the known types of the stack slots pushed since the loop header and of the locals, values already
+    // known to be numbers aren't guarded again. the baseline code knows nothing since it can be entered anywhere
+    int depth;
+    uint8_t stackTypes[STACK_HEADROOM];
+    uint8_t localTypes[UINT8_COUNT];
+    Fixup* jumps;
+    int jumpCount;
+    int jumpCapacity;
+    Fixup* exits;
+    int exitCount;
+    int exitCapacity;
+} Assembler;
+
+/// grows a malloc'ed array, the code being compiled isn't a Lox object so none of this goes through the GC
+/// @param array    the array
+/// @param capacity its capacity, updated
+/// @param size     the size of an element
+/// @return         the grown array
+static void* growArray(void* array, int* capacity, size_t size)
+{
+    *capacity = *capacity < 64 ? 64 : *capacity * 2;
+    array = realloc(array, size * *capacity);
+    if (array == NULL) exit(1);
+    return array;
+}
+
+static void emitByte(Assembler* as, uint8_t byte)
+{
+    Buffer* buffer = &as->buffer;
+    if (buffer->count == buffer->capacity)
+    {
+        buffer->code = growArray(buffer->code, &buffer->capacity, 1);
+    }
+    buffer->code[buffer->count++] = byte;
+}
+
+static void emitBytes(Assembler* as, int count, const uint8_t* bytes)
+{
+    for (int i = 0; i < count; i++) emitByte(as, bytes[i]);
+}
+
+static void emit32(Assembler* as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+/// points the rel32 at `at` to `target`
+static void patch32(Assembler* as, int at, int target)
+{
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    for (int i = 0; i < 4; i++) as->buffer.code[at + i] = (uint8_t)(rel >> (8 * i));
+}
+
+static void addFixup(Fixup** fixups, int* count, int* capacity, Fixup fixup)
+{
+    if (*count == *capacity) *fixups = growArray(*fixups, capacity, sizeof(Fixup));
+    (*fixups)[(*count)++] = fixup;
+}
+
+/// emits a 64-bit instruction on two registers, `reg` goes in the ModRM reg field and `rm` in the r/m field
+static void emitRegReg(Assembler* as, uint8_t opcode, int reg, int rm)
+{
+    emitByte(as, 0x48 | (reg & 8) >> 1 | (rm & 8) >> 3);
+    emitByte(as, opcode);
+    emitByte(as, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/// emits an instruction on a register and [base + disp]
+/// @param wide whether the operands are 64-bit, otherwise 32-bit
+static void emitRegMemSized(Assembler* as, bool wide, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    bool shortDisp = disp >= INT8_MIN && disp <= INT8_MAX;
+    uint8_t rex = (wide ? 0x48 : 0x40) | (reg & 8) >> 1 | (base & 8) >> 3;
+    if (rex != 0x40) emitByte(as, rex);
+    emitByte(as, opcode);
+    emitByte(as, (shortDisp ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    // rsp and r12 as a base need a SIB byte
+    if ((base & 7) == RSP) emitByte(as, 0x24);
+    if (shortDisp) emitByte(as, (uint8_t)disp);
+    else emit32(as, (uint32_t)disp);
+}
+
+/// emits a 64-bit instruction on a register and [base + disp]
+static void emitRegMem(Assembler* as, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    emitRegMemSized(as, true, opcode, reg, base, disp);
+}
+
+// mov dst, imm64
+static void emitMovImm(Assembler* as, int dst, uint64_t value)
+{
+    emitByte(as, 0x48 | (dst & 8) >> 3);
+    emitByte(as, 0xb8 + (dst & 7));
+    emit64(as, value);
+}
+
+// mov dst, [base + disp]
+static void emitLoad(Assembler* as, int dst, int base, int32_t disp)
+{
+    emitRegMem(as, 0x8b, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void emitStore(Assembler* as, int base, int32_t disp, int src)
+{
+    emitRegMem(as, 0x89, src, base, disp);
+}
+
+// add reg, imm8
+static void emitAddImm(Assembler* as, int reg, int32_t value)
+{
+    emitByte(as, 0x48 | (reg & 8) >> 3);
+    emitByte(as, 0x83);
+    emitByte(as, 0xc0 | (reg & 7));
+    emitByte(as, (uint8_t)(int8_t)value);
+}
+
+// call the C function at `function` through rax
+static void emitCall(Assembler* as, void* function)
+{
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)function);
+    emitBytes(as, 2, (uint8_t[]){0xff, 0xd0});
+}
+
+/// emits a jcc (or a jmp when `condition` is -1) to the instruction at a bytecode offset
+static void emitJump(Assembler* as, int condition, int offset)
+{
+    if (condition == -1) emitByte(as, 0xe9);
+    else emitBytes(as, 2, (uint8_t[]){0x0f, 0x80 | condition});
+    addFixup(&as->jumps, &as->jumpCount, &as->jumpCapacity, (Fixup){as->buffer.count, offset, 0});
+    emit32(as, 0);
+}
+
+/// emits a jcc forward within the code being emitted
+/// @return where its rel32 is, patched with patch32() once the code it skips is emitted
+static int emitSkip(Assembler* as, int condition)
+{
+    emitBytes(as, 2, (uint8_t[]){0x0f, 0x80 | condition});
+    emit32(as, 0);
+    return as->buffer.count - 4;
+}
+
+/// emits a jcc to an exit stub that hands the instruction at a bytecode offset back to the interpreter
+static void emitExitJump(Assembler* as, int condition, int offset, int kind)
+{
+    emitBytes(as, 2, (uint8_t[]){0x0f, 0x80 | condition});
+    addFixup(&as->exits, &as->exitCount, &as->exitCapacity, (Fixup){as->buffer.count, offset, kind});
+    emit32(as, 0);
+}
+
+// the condition codes the templates use
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_G 0xf
+
+/// emits the code that writes the state back to the VM and returns to the interpreter at a bytecode offset
+static void emitExit(Assembler* as, int offset, int kind)
+{
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitStore(as, RAX, 0, STACK_REG);
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)(as->function->chunk.code + offset));
+    emitStore(as, FRAME_REG, (int32_t)offsetof(CallFrame, ip), RAX);
+    emitByte(as, 0xb8);
+    emit32(as, (uint32_t)kind);
+    emitByte(as, 0xe9);
+    emit32(as, 0);
+    patch32(as, as->buffer.count - 4, as->epilogue);
+}
+
+// the value `depth` slots below the top of the stack, 1 being the top
+static void emitPeek(Assembler* as, int dst, int depth)
+{
+    emitLoad(as, dst, STACK_REG, -8 * depth);
+}
+
+static void emitPush(Assembler* as, int src)
+{
+    emitStore(as, STACK_REG, 0, src);
+    emitAddImm(as, STACK_REG, 8);
+}
+
+static void emitDrop(Assembler* as, int count)
+{
+    emitAddImm(as, STACK_REG, -8 * count);
+}
+
+/// the known type of the value `depth` slots below the top of the stack, 1 being the top
+static uint8_t peekType(Assembler* as, int depth)
+{
+    int index = as->depth - depth;
+    return index >= 0 && index < STACK_HEADROOM ? as->stackTypes[index] : TYPE_UNKNOWN;
+}
+
+static void pushType(Assembler* as, uint8_t type)
+{
+    if (as->depth >= 0 && as->depth < STACK_HEADROOM) as->stackTypes[as->depth] = type;
+    as->depth++;
+}
+
+/// bails out to the interpreter at `offset` unless `reg` holds a number, uses rdx and rsi
+/// @param type what's known about the value, nothing is emitted for a known number
+static void emitNumberGuard(Assembler* as, int reg, uint8_t type, int offset)
+{
+    if (type == TYPE_NUMBER) return;
+    emitMovImm(as, RDX, QNAN);
+    emitRegReg(as, 0x89, reg, RSI);
+    emitRegReg(as, 0x21, RDX, RSI);
+    emitRegReg(as, 0x39, RDX, RSI);
+    emitExitJump(as, CC_E, offset, JIT_BAIL);
+}
+
+/// turns the flag byte in al into a bool value in rax
+static void emitBoolFromAl(Assembler* as)
+{
+    emitBytes(as, 3, (uint8_t[]){0x0f, 0xb6, 0xc0}); // movzx eax, al
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitRegReg(as, 0x01, RCX, RAX);                  // TRUE_VAL is FALSE_VAL + 1
+}
+
+/// the arithmetic on two numbers in rax and rcx, the result replaces them with the SSE2 opcode `op`
+/// (0x58 addsd, 0x5c subsd, 0x59 mulsd, 0x5e divsd) or, with `compare`, the bool of a ucomisd
+/// @param swap for comparisons, whether to compare b with a (for less than) instead of a with b
+static void emitNumberOp(Assembler* as, uint8_t op, bool compare, bool swap)
+{
+    emitBytes(as, 5, (uint8_t[]){0x66, 0x48, 0x0f, 0x6e, 0xc0}); // movq xmm0, rax
+    emitBytes(as, 5, (uint8_t[]){0x66, 0x48, 0x0f, 0x6e, 0xc9}); // movq xmm1, rcx
+    if (compare)
+    {
+        // seta is false for unordered operands, so a comparison with NaN is false like in C
+        emitBytes(as, 4, (uint8_t[]){0x66, 0x0f, 0x2e, swap ? 0xc8 : 0xc1});
+        emitBytes(as, 3, (uint8_t[]){0x0f, 0x97, 0xc0});
+        emitBoolFromAl(as);
+    }
+    else
+    {
+        emitBytes(as, 4, (uint8_t[]){0xf2, 0x0f, op, 0xc1});
+        emitBytes(as, 5, (uint8_t[]){0x66, 0x48, 0x0f, 0x7e, 0xc0}); // movq rax, xmm0
+    }
+}
+
+/// a binary operation on the two numbers on top of the stack
+static void emitBinary(Assembler* as, int offset, uint8_t op, bool compare, bool swap)
+{
+    emitPeek(as, RAX, 2);
+    emitPeek(as, RCX, 1);
+    emitNumberGuard(as, RAX, peekType(as, 2), offset);
+    emitNumberGuard(as, RCX, peekType(as, 1), offset);
+    emitNumberOp(as, op, compare, swap);
+    emitStore(as, STACK_REG, -16, RAX);
+    emitDrop(as, 1);
+}
+
+/// a binary operation on the top of the stack and a constant operand, which has to be a number
+static bool emitBinaryConstant(Assembler* as, int offset, Value constant, uint8_t op, bool compare)
+{
+    if (!IS_NUMBER(constant)) return false;
+    emitPeek(as, RAX, 1);
+    emitNumberGuard(as, RAX, peekType(as, 1), offset);
+    emitMovImm(as, RCX, constant);
+    emitNumberOp(as, op, compare, true);
+    emitStore(as, STACK_REG, -8, RAX);
+    return true;
+}
+
+/// jumps to `target` if the value in rax is falsey
+static void emitJumpIfFalsey(Assembler* as, int target)
+{
+    emitMovImm(as, RCX, NIL_VAL);
+    emitRegReg(as, 0x39, RCX, RAX);
+    emitJump(as, CC_E, target);
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitRegReg(as, 0x39, RCX, RAX);
+    emitJump(as, CC_E, target);
+}
+
+/// loads the address of an upvalue's variable into `dst`
+static void emitUpvalueLocation(Assembler* as, int dst, int index)
+{
+    emitLoad(as, dst, FRAME_REG, (int32_t)offsetof(CallFrame, closure));
+    emitLoad(as, dst, dst, (int32_t)offsetof(ObjClosure, upvalues));
+    emitLoad(as, dst, dst, index * (int32_t)sizeof(ObjUpvalue*));
+    emitLoad(as, dst, dst, (int32_t)offsetof(ObjUpvalue, location));
+}
+
+/// loads a global slot's value into rax and its array into rcx, bailing out while it's undefined
+static void emitGlobal(Assembler* as, int slot, int offset)
+{
+    emitMovImm(as, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    emitLoad(as, RCX, RCX, 0);
+    emitLoad(as, RAX, RCX, slot * (int32_t)sizeof(Value));
+    emitMovImm(as, RDX, UNDEFINED_VAL);
+    emitRegReg(as, 0x39, RDX, RAX);
+    emitExitJump(as, CC_E, offset, JIT_BAIL);
+}
+
+/// counts a back edge like the interpreter does, but hands it to the interpreter when the loop has a trace to run or
+/// when it's the back edge that makes the loop hot, so the interpreter records the trace
+static void emitLoopCounter(Assembler* as, int offset, LoopCounter* loop)
+{
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)loop);
+    emitRegMem(as, 0x83, 7, RAX, (int32_t)offsetof(LoopCounter, trace)); // cmp qword [rax + trace], 0
+    emitByte(as, 0);
+    emitExitJump(as, CC_NE, offset, JIT_EXIT);
+    emitRegMemSized(as, false, 0x81, 7, RAX, (int32_t)offsetof(LoopCounter, count)); // cmp dword [rax + count], imm
+    emit32(as, (uint32_t)(vm.traceThreshold - 1));
+    emitExitJump(as, CC_E, offset, JIT_EXIT);
+    int counted = emitSkip(as, CC_G);
+    emitRegMemSized(as, false, 0xff, 0, RAX, (int32_t)offsetof(LoopCounter, count)); // inc dword [rax + count]
+    patch32(as, counted, as->buffer.count);
+}
+
+static void printLine(Value value)
+{
+    printValue(value);
+    printf("\n");
+}
+
+/// the length of the instruction at an offset
+/// @return the length in bytes, -1 for an unknown opcode
+static int instructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+    case OP_SET_LOCAL_POP:
+        return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_ADD_LOCALS:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+        return 4;
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 5;
+    case OP_CLOSURE:
+        return 2 + 2 * AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]])->upvalueCount;
+    case OP_RETURN:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_NUM:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+/// emits the template of one instruction
+/// @return false for the instructions left to the interpreter: calls, returns, closures, classes and property
+///         accesses, which allocate, grow the stacks or go through the inline caches
+static bool emitInstruction(Assembler* as, int offset, int length)
+{
+    Chunk* chunk = &as->function->chunk;
+    uint8_t* ip = chunk->code + offset;
+    Value* constants = chunk->constants.values;
+    // the 16-bit operand of the jumps and the global instructions
+    uint16_t operand = length >= 3 ? (uint16_t)(ip[1] << 8 | ip[2]) : 0;
+
+    // the quickened instructions run the templates of their generic ones, while OP_ADD is only compiled for numbers
+    // since a site that has already seen strings is OP_ADD_STR by now
+    switch (ip[0])
+    {
+    case OP_CONSTANT:
+        emitMovImm(as, RAX, constants[ip[1]]);
+        emitPush(as, RAX);
+        return true;
+    case OP_CONSTANT_LONG:
+        emitMovImm(as, RAX, constants[(uint32_t)ip[3] << 16 | (uint16_t)ip[2] << 8 | ip[1]]);
+        emitPush(as, RAX);
+        return true;
+    case OP_NIL:
+        emitMovImm(as, RAX, NIL_VAL);
+        emitPush(as, RAX);
+        return true;
+    case OP_TRUE:
+        emitMovImm(as, RAX, TRUE_VAL);
+        emitPush(as, RAX);
+        return true;
+    case OP_FALSE:
+        emitMovImm(as, RAX, FALSE_VAL);
+        emitPush(as, RAX);
+        return true;
+    case OP_POP:
+        emitDrop(as, 1);
+        return true;
+    case OP_GET_LOCAL:
+        emitLoad(as, RAX, SLOTS_REG, ip[1] * (int32_t)sizeof(Value));
+        emitPush(as, RAX);
+        return true;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+        emitPeek(as, RAX, 1);
+        emitStore(as, SLOTS_REG, ip[1] * (int32_t)sizeof(Value), RAX);
+        if (ip[0] == OP_SET_LOCAL_POP) emitDrop(as, 1);
+        return true;
+    case OP_GET_GLOBAL:
+        emitGlobal(as, operand, offset);
+        emitPush(as, RAX);
+        return true;
+    case OP_SET_GLOBAL:
+        emitGlobal(as, operand, offset);
+        emitPeek(as, RAX, 1);
+        emitStore(as, RCX, operand * (int32_t)sizeof(Value), RAX);
+        return true;
+    case OP_DEFINE_GLOBAL:
+        emitMovImm(as, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+        emitLoad(as, RCX, RCX, 0);
+        emitPeek(as, RAX, 1);
+        emitStore(as, RCX, operand * (int32_t)sizeof(Value), RAX);
+        emitDrop(as, 1);
+        return true;
+    case OP_GET_UPVALUE:
+        emitUpvalueLocation(as, RAX, ip[1]);
+        emitLoad(as, RAX, RAX, 0);
+        emitPush(as, RAX);
+        return true;
+    case OP_SET_UPVALUE:
+        emitUpvalueLocation(as, RCX, ip[1]);
+        emitPeek(as, RAX, 1);
+        emitStore(as, RCX, 0, RAX);
+        return true;
+    case OP_ADD:
+    case OP_ADD_NUM:
+        emitBinary(as, offset, 0x58, false, false);
+        return true;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+        emitBinary(as, offset, 0x5c, false, false);
+        return true;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+        emitBinary(as, offset, 0x59, false, false);
+        return true;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+        emitBinary(as, offset, 0x5e, false, false);
+        return true;
+    case OP_LESS:
+    case OP_LESS_NUM:
+        emitBinary(as, offset, 0, true, true);
+        return true;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+        emitBinary(as, offset, 0, true, false);
+        return true;
+    case OP_ADD_LOCALS:
+        emitLoad(as, RAX, SLOTS_REG, ip[1] * (int32_t)sizeof(Value));
+        emitLoad(as, RCX, SLOTS_REG, ip[2] * (int32_t)sizeof(Value));
+        emitNumberGuard(as, RAX, as->localTypes[ip[1]], offset);
+        emitNumberGuard(as, RCX, as->localTypes[ip[2]], offset);
+        emitNumberOp(as, 0x58, false, false);
+        emitPush(as, RAX);
+        return true;
+    case OP_ADD_CONSTANT:
+        return emitBinaryConstant(as, offset, constants[ip[1]], 0x58, false);
+    case OP_SUBTRACT_CONSTANT:
+        return emitBinaryConstant(as, offset, constants[ip[1]], 0x5c, false);
+    case OP_LESS_CONSTANT:
+        return emitBinaryConstant(as, offset, constants[ip[1]], 0, true);
+    case OP_NEGATE:
+        emitPeek(as, RAX, 1);
+        emitNumberGuard(as, RAX, peekType(as, 1), offset);
+        emitMovImm(as, RCX, SIGN_BIT);
+        emitRegReg(as, 0x31, RCX, RAX);
+        emitStore(as, STACK_REG, -8, RAX);
+        return true;
+    case OP_NOT:
+        emitPeek(as, RDX, 1);
+        emitMovImm(as, RCX, NIL_VAL);
+        emitRegReg(as, 0x39, RCX, RDX);
+        emitBytes(as, 3, (uint8_t[]){0x0f, 0x94, 0xc0}); // sete al
+        emitMovImm(as, RCX, FALSE_VAL);
+        emitRegReg(as, 0x39, RCX, RDX);
+        emitBytes(as, 3, (uint8_t[]){0x0f, 0x94, 0xc1}); // sete cl
+        emitBytes(as, 2, (uint8_t[]){0x08, 0xc8});       // or al, cl
+        emitBoolFromAl(as);
+        emitStore(as, STACK_REG, -8, RAX);
+        return true;
+    case OP_EQUAL:
+        emitPeek(as, RDI, 2);
+        emitPeek(as, RSI, 1);
+        emitCall(as, valuesEqual);
+        emitBoolFromAl(as);
+        emitStore(as, STACK_REG, -16, RAX);
+        emitDrop(as, 1);
+        return true;
+    case OP_PRINT:
+        emitPeek(as, RDI, 1);
+        emitDrop(as, 1);
+        emitCall(as, printLine);
+        return true;
+    case OP_JUMP:
+        emitJump(as, -1, offset + 3 + operand);
+        return true;
+    case OP_LOOP:
+        emitLoopCounter(as, offset, &chunk->loops[ip[3] << 8 | ip[4]]);
+        emitJump(as, -1, offset + 5 - operand);
+        return true;
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+        emitPeek(as, RAX, 1);
+        if (ip[0] == OP_POP_JUMP_IF_FALSE) emitDrop(as, 1);
+        emitJumpIfFalsey(as, offset + 3 + operand);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// emits the prologue, which saves the callee-saved registers (keeping the stack 16-byte aligned for the helper
+/// calls), loads the interpreter state and jumps to the instruction to run, and the epilogue that returns to C
+static void emitPrologue(Assembler* as)
+{
+    emitBytes(as, 11, (uint8_t[]){0x55, 0x48, 0x89, 0xe5, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56});
+    emitRegReg(as, 0x89, RDI, STACK_REG);
+    emitRegReg(as, 0x89, RSI, SLOTS_REG);
+    emitRegReg(as, 0x89, RDX, FRAME_REG);
+    emitBytes(as, 2, (uint8_t[]){0xff, 0xe1}); // jmp rcx
+    as->epilogue = as->buffer.count;
+    emitBytes(as, 9, (uint8_t[]){0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0x5d, 0xc3});
+}
+
+/// emits the exit stubs and copies the code into a writable mapping that becomes executable only once it's no
+/// longer writable
+/// @param size the mapped size, set on success
+/// @return     the mapped code, NULL if it couldn't be mapped
+static uint8_t* finishCode(Assembler* as, size_t* size)
+{
+    for (int i = 0; i < as->exitCount; i++)
+    {
+        patch32(as, as->exits[i].at, as->buffer.count);
+        emitExit(as, as->exits[i].offset, as->exits[i].kind);
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *size = ((size_t)as->buffer.count + page - 1) / page * page;
+    uint8_t* code = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+    memcpy(code, as->buffer.code, as->buffer.count);
+    mprotect(code, *size, PROT_READ | PROT_EXEC);
+    return code;
+}
+
+static void freeAssembler(Assembler* as)
+{
+    free(as->buffer.code);
+    free(as->jumps);
+    free(as->exits);
+    free(as);
+}
+
+/// compiles a function's bytecode to machine code, one template per instruction
+/// @param function the function, its code is stored in function->jit
+/// @return         false when the function can't be compiled, it keeps running in the interpreter
+bool jitCompile(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    Assembler* as = calloc(1, sizeof(Assembler));
+    uint32_t* native = calloc(chunk->count + 1, sizeof(uint32_t));
+    uint32_t* entries = calloc(chunk->count + 1, sizeof(uint32_t));
+    int* starts = malloc(sizeof(int) * (chunk->count + 1));
+    int* runs = calloc(chunk->count + 1, sizeof(int));
+    if (as == NULL || native == NULL || entries == NULL || starts == NULL || runs == NULL) exit(1);
+    int startCount = 0;
+    as->function = function;
+    emitPrologue(as);
+
+    bool compiled = true;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        int length = instructionLength(chunk, offset);
+        if (length == -1)
+        {
+            compiled = false;
+            break;
+        }
+
+        starts[startCount++] = offset;
+        native[offset] = (uint32_t)as->buffer.count;
+        if (emitInstruction(as, offset, length))
+        {
+            entries[offset] = native[offset];
+        }
+        else
+        {
+            emitExit(as, offset, JIT_EXIT);
+        }
+        offset += length;
+    }
+
+    // the interpreter only hands an instruction to the code when the code runs for a while from there, entering and
+    // leaving it costs about as much as interpreting a few instructions. a back edge keeps the code running
+    for (int i = startCount - 1; compiled && i >= 0; i--)
+    {
+        int offset = starts[i];
+        if (entries[offset] == 0) continue;
+
+        uint8_t* ip = &chunk->code[offset];
+        int next = offset + instructionLength(chunk, offset);
+        if (ip[0] == OP_JUMP) next += ip[1] << 8 | ip[2];
+        runs[offset] = ip[0] == OP_LOOP ? JIT_MIN_RUN : runs[next] + 1;
+        if (runs[offset] < JIT_MIN_RUN) entries[offset] = 0;
+    }
+
+    size_t size;
+    uint8_t* code = NULL;
+    if (compiled)
+    {
+        for (int i = 0; i < as->jumpCount; i++) patch32(as, as->jumps[i].at, (int)native[as->jumps[i].offset]);
+        code = finishCode(as, &size);
+    }
+
+    if (code != NULL)
+    {
+        JitCode* jit = malloc(sizeof(JitCode));
+        if (jit == NULL) exit(1);
+        jit->code = code;
+        jit->size = size;
+        jit->entries = entries;
+        jit->bailouts = 0;
+        function->jit = jit;
+    }
+    else
+    {
+        free(entries);
+    }
+    free(native);
+    free(starts);
+    free(runs);
+    freeAssembler(as);
+    return code != NULL;
+}
+
+/// frees a function's baseline machine code, its traces stay
+static void freeCode(ObjFunction* function)
+{
+    JitCode* jit = function->jit;
+    if (jit == NULL) return;
+    munmap(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+    function->jit = NULL;
+}
+
+/// runs the machine code of the top frame's function from the frame's ip, until it hands an instruction back to
+/// the interpreter. the frame's ip and the stack top are left where the interpreter has to carry on
+/// @param frame the top frame, its state has to be spilled
+void jitRun(CallFrame* frame)
+{
+    ObjFunction* function = frame->closure->function;
+    JitCode* jit = function->jit;
+    uint32_t entry = jit->entries[frame->ip - function->chunk.code];
+    if (entry == 0) return;
+
+    int result = ((JitEntry)jit->code)(vm.stackTop, frame->slots, frame, jit->code + entry);
+
+    // code whose guards keep failing was compiled for types the function doesn't see, it's not compiled again
+    if (result == JIT_BAIL && ++jit->bailouts == JIT_MAX_BAILOUTS) freeCode(function);
+}
+
+// one recorded instruction of a trace
+typedef struct
+{
+    int offset;
+    bool numbers; // arithmetic and comparisons: the operands were all numbers
+    bool native;  // OP_CALL: the callee was a native function
+} TraceStep;
+
+// the trace being recorded, the instructions the loop's frame ran since the loop header
+static struct
+{
+    ObjFunction* function;
+    int frame;         // the index of the loop's frame, the instructions of its callees aren't part of the trace
+    LoopCounter* loop;
+    int head;          // the offset of the loop header
+    TraceStep steps[TRACE_MAX_LENGTH];
+    int count;
+} recorder;
+
+/// starts recording a trace of a loop that got hot
+/// @param frame the loop's frame, its ip at the loop header
+/// @param loop  the loop's counter
+/// @return      true, the interpreter calls jitRecord() before every instruction until it returns false
+bool jitStartTrace(CallFrame* frame, LoopCounter* loop)
+{
+    recorder.function = frame->closure->function;
+    recorder.frame = (int)(frame - vm.frames);
+    recorder.loop = loop;
+    recorder.head = (int)(frame->ip - recorder.function->chunk.code);
+    recorder.count = 0;
+    return true;
+}
+
+/// @return whether the recorded path already went through an instruction, besides the loop header
+static bool isRecorded(int offset)
+{
+    for (int i = 1; i < recorder.count; i++)
+    {
+        if (recorder.steps[i].offset == offset) return true;
+    }
+    return false;
+}
+
+/// counts a recording that didn't end in a trace, a loop is only recorded TRACE_MAX_RECORDINGS times
+static void stopRecording(LoopCounter* loop)
+{
+    loop->recordings++;
+    loop->count = loop->recordings < TRACE_MAX_RECORDINGS ? 0 : vm.traceThreshold;
+}
+
+/// updates the known types with the effect of an instruction the trace compiled with emitInstruction()
+static void trackTypes(Assembler* as, uint8_t* ip)
+{
+    switch (ip[0])
+    {
+    case OP_CONSTANT:
+        pushType(as, IS_NUMBER(as->function->chunk.constants.values[ip[1]]) ? TYPE_NUMBER : TYPE_UNKNOWN);
+        break;
+    case OP_TRUE:
+    case OP_FALSE:
+        pushType(as, TYPE_BOOL);
+        break;
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+        pushType(as, TYPE_UNKNOWN);
+        break;
+    case OP_GET_LOCAL:
+        pushType(as, as->localTypes[ip[1]]);
+        break;
+    case OP_SET_LOCAL:
+        as->localTypes[ip[1]] = peekType(as, 1);
+        break;
+    case OP_SET_LOCAL_POP:
+        as->localTypes[ip[1]] = peekType(as, 1);
+        as->depth--;
+        break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+        as->depth--;
+        break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+        as->depth -= 2;
+        pushType(as, TYPE_NUMBER);
+        break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_EQUAL:
+        as->depth -= 2;
+        pushType(as, TYPE_BOOL);
+        break;
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_NEGATE:
+        as->depth--;
+        pushType(as, TYPE_NUMBER);
+        break;
+    case OP_LESS_CONSTANT:
+    case OP_NOT:
+        as->depth--;
+        pushType(as, TYPE_BOOL);
+        break;
+    case OP_ADD_LOCALS:
+        pushType(as, TYPE_NUMBER);
+        break;
+    default:
+        break;
+    }
+}
+
+/// emits a native function call, guarded on the callee being a native function
+static void emitNativeCall(Assembler* as, int offset, int argCount)
+{
+    emitPeek(as, RAX, argCount + 1);
+    emitMovImm(as, RCX, SIGN_BIT | QNAN);
+    emitRegReg(as, 0x89, RAX, RDX);
+    emitRegReg(as, 0x21, RCX, RDX);
+    emitRegReg(as, 0x39, RCX, RDX);
+    emitExitJump(as, CC_NE, offset, JIT_BAIL);
+    emitMovImm(as, RCX, ~(SIGN_BIT | QNAN));
+    emitRegReg(as, 0x21, RCX, RAX);
+    emitRegMemSized(as, false, 0x83, 7, RAX, (int32_t)offsetof(Obj, type)); // cmp dword [rax + type], OBJ_NATIVE
+    emitByte(as, OBJ_NATIVE);
+    emitExitJump(as, CC_NE, offset, JIT_BAIL);
+    emitLoad(as, RCX, RAX, (int32_t)offsetof(ObjNative, function));
+
+    // the native can allocate, the GC has to see the arguments
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitStore(as, RAX, 0, STACK_REG);
+    emitByte(as, 0xbf); // mov edi, argCount
+    emit32(as, (uint32_t)argCount);
+    emitRegMem(as, 0x8d, RSI, STACK_REG, -8 * argCount); // lea rsi, [rbx - 8 * argCount]
+    emitBytes(as, 2, (uint8_t[]){0xff, 0xd1});           // call rcx
+    emitStore(as, STACK_REG, -8 * (argCount + 1), RAX);
+    if (argCount > 0) emitDrop(as, argCount);
+}
+
+/// emits one recorded instruction of a trace, branches become guards that the recorded path is taken
+/// @param next the offset of the instruction recorded after this one
+/// @return     false for the instructions the trace leaves to the interpreter, the trace ends there
+static bool emitTraceStep(Assembler* as, TraceStep* step, int next)
+{
+    uint8_t* ip = as->function->chunk.code + step->offset;
+    switch (ip[0])
+    {
+    case OP_JUMP:
+    case OP_LOOP:
+        // the trace is laid out in the order it ran, compileTrace() closes it with the jump back to the header
+        return true;
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+        {
+            int target = step->offset + 3 + (ip[1] << 8 | ip[2]);
+            bool falsey = next == target;
+            uint8_t type = peekType(as, 1);
+            emitPeek(as, RAX, 1);
+            if (ip[0] == OP_POP_JUMP_IF_FALSE)
+            {
+                emitDrop(as, 1);
+                as->depth--;
+            }
+
+            // leaves the trace for the path that wasn't recorded, a known bool only has to be compared to false
+            int exit = falsey ? step->offset + 3 : target;
+            int nil = -1;
+            if (type != TYPE_BOOL)
+            {
+                emitMovImm(as, RCX, NIL_VAL);
+                emitRegReg(as, 0x39, RCX, RAX);
+                if (falsey) nil = emitSkip(as, CC_E);
+                else emitExitJump(as, CC_E, exit, JIT_EXIT);
+            }
+            emitMovImm(as, RCX, FALSE_VAL);
+            emitRegReg(as, 0x39, RCX, RAX);
+            emitExitJump(as, falsey ? CC_NE : CC_E, exit, JIT_EXIT);
+            if (nil != -1) patch32(as, nil, as->buffer.count);
+            return true;
+        }
+    case OP_CALL:
+        if (!step->native) return false;
+        emitNativeCall(as, step->offset, ip[1]);
+        as->depth -= ip[1] + 1;
+        pushType(as, TYPE_UNKNOWN);
+        return true;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_NEGATE:
+    case OP_ADD_LOCALS:
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+        // operands that weren't numbers while recording are left to the interpreter
+        if (!step->numbers) return false;
+        break;
+    default:
+        break;
+    }
+
+    if (!emitInstruction(as, step->offset, instructionLength(&as->function->chunk, step->offset))) return false;
+    trackTypes(as, ip);
+    return true;
+}
+
+/// compiles the recorded trace into a native loop, with side exits wherever the recorded path or types don't hold
+/// @return the trace, NULL if it would leave to the interpreter right away
+static JitTrace* compileTrace()
+{
+    Assembler* as = calloc(1, sizeof(Assembler));
+    if (as == NULL) exit(1);
+    as->function = recorder.function;
+    emitPrologue(as);
+
+    int head = as->buffer.count;
+    int emitted = 0;
+    for (; emitted < recorder.count; emitted++)
+    {
+        TraceStep* step = &recorder.steps[emitted];
+        int next = emitted + 1 < recorder.count ? recorder.steps[emitted + 1].offset : recorder.head;
+        if (!emitTraceStep(as, step, next))
+        {
+            emitExit(as, step->offset, JIT_EXIT);
+            break;
+        }
+    }
+    if (emitted == recorder.count)
+    {
+        emitByte(as, 0xe9);
+        emit32(as, 0);
+        patch32(as, as->buffer.count - 4, head);
+    }
+
+    JitTrace* trace = NULL;
+    size_t size;
+    uint8_t* code = emitted == 0 ? NULL : finishCode(as, &size);
+    if (code != NULL)
+    {
+        trace = malloc(sizeof(JitTrace));
+        if (trace == NULL) exit(1);
+        trace->code = code;
+        trace->size = size;
+        trace->entry = (uint32_t)head;
+        trace->bailouts = 0;
+    }
+    freeAssembler(as);
+    return trace;
+}
+
+/// records the next instruction of the trace, called by the interpreter before it runs it
+/// @param frame the top frame, its state has to be spilled
+/// @return      whether the recording goes on
+bool jitRecord(CallFrame* frame)
+{
+    int index = (int)(frame - vm.frames);
+    if (index > recorder.frame) return true;
+
+    // the trace is given up when the loop's frame returns, when the path gets too long (which is what happens when
+    // it leaves the loop) or when it jumps back into itself anywhere but the header: that's an inner loop, which gets
+    // its own trace and may already be running it
+    ObjFunction* function = frame->closure->function;
+    int offset = (int)(frame->ip - function->chunk.code);
+    if (index < recorder.frame || function != recorder.function || recorder.count == TRACE_MAX_LENGTH ||
+        (frame->ip[0] == OP_LOOP && isRecorded(offset + 5 - (frame->ip[1] << 8 | frame->ip[2]))))
+    {
+        stopRecording(recorder.loop);
+        return false;
+    }
+
+    // back at the header: the recorded path is one iteration of the loop
+    if (offset == recorder.head && recorder.count > 0)
+    {
+        JitTrace* trace = compileTrace();
+        if (trace == NULL)
+        {
+            stopRecording(recorder.loop);
+        }
+        else
+        {
+            recorder.loop->recordings++;
+            recorder.loop->trace = trace;
+        }
+        return false;
+    }
+
+    TraceStep* step = &recorder.steps[recorder.count++];
+    uint8_t* ip = frame->ip;
+    Value* top = vm.stackTop;
+    step->offset = offset;
+    step->numbers = false;
+    step->native = false;
+    switch (ip[0])
+    {
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+        step->numbers = IS_NUMBER(top[-1]) && IS_NUMBER(top[-2]);
+        break;
+    case OP_NEGATE:
+        step->numbers = IS_NUMBER(top[-1]);
+        break;
+    case OP_ADD_LOCALS:
+        step->numbers = IS_NUMBER(frame->slots[ip[1]]) && IS_NUMBER(frame->slots[ip[2]]);
+        break;
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+        step->numbers = IS_NUMBER(top[-1]) && IS_NUMBER(function->chunk.constants.values[ip[1]]);
+        break;
+    case OP_CALL:
+        step->native = IS_NATIVE(top[-1 - ip[1]]);
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+static void freeTrace(JitTrace* trace)
+{
+    munmap(trace->code, trace->size);
+    free(trace);
+}
+
+/// runs a loop's trace from the loop header, until a side exit hands the frame back to the interpreter
+/// @param frame the loop's frame, its state has to be spilled and its ip at the loop header
+/// @param loop  the loop's counter
+void jitRunTrace(CallFrame* frame, LoopCounter* loop)
+{
+    JitTrace* trace = loop->trace;
+    int result = ((JitEntry)trace->code)(vm.stackTop, frame->slots, frame, trace->code + trace->entry);
+
+    // a trace whose type guards keep failing is recorded again, as long as the loop has recordings left
+    if (result == JIT_BAIL && ++trace->bailouts == JIT_MAX_BAILOUTS)
+    {
+        freeTrace(trace);
+        loop->trace = NULL;
+        loop->count = loop->recordings < TRACE_MAX_RECORDINGS ? 0 : vm.traceThreshold;
+    }
+}
+
+/// frees a function's machine code and the traces of its loops
+/// @param function the function, it runs in the interpreter afterward
+void jitFree(ObjFunction* function)
+{
+    freeCode(function);
+    Chunk* chunk = &function->chunk;
+    for (int i = 0; i < chunk->loopCount; i++)
+    {
+        if (chunk->loops[i].trace != NULL)
+        {
+            freeTrace(chunk->loops[i].trace);
+            chunk->loops[i].trace = NULL;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "common.h"
+
+#ifdef CLOX_JIT
+
+#include "object.h"
+#include "vm.h"
+
+// the calls a function takes before it is compiled to machine code
+#define JIT_THRESHOLD 1000
+// the instructions the machine code has to run from an instruction on for the interpreter to enter it there
+#define JIT_MIN_RUN 4
+// the failed type guards a function's machine code or a trace survives before it's thrown away
+#define JIT_MAX_BAILOUTS 64
+// the back edges a loop takes before its body is recorded as a trace
+#define TRACE_THRESHOLD 100
+// the longest trace recorded, in instructions
+#define TRACE_MAX_LENGTH 512
+// the traces recorded for one loop before it's left to the interpreter for good
+#define TRACE_MAX_RECORDINGS 4
+
+// the machine code of a hot function. it runs on the VM's own stacks, so the interpreter can take over at any
+// instruction the code leaves to it and hand the frame back at the next call, return or loop
+typedef struct JitCode
+{
+    uint8_t* code;     // the mapped code, executable and no longer writable
+    size_t size;       // its mapped size
+    uint32_t* entries; // where each instruction starts in the code, 0 for the ones left to the interpreter
+    int bailouts;
+} JitCode;
+
+// the native code of a hot loop, compiled from the path its body took while it was recorded. it loops in native code
+// until the path or the types seen while recording stop holding, and exits to the interpreter there
+typedef struct JitTrace
+{
+    uint8_t* code;
+    size_t size;
+    uint32_t entry; // where the loop header is in the code
+    int bailouts;
+} JitTrace;
+
+bool jitCompile(ObjFunction* function);
+
+bool jitStartTrace(CallFrame* frame, LoopCounter* loop);
+
+bool jitRecord(CallFrame* frame);
+
+void jitRunTrace(CallFrame* frame, LoopCounter* loop);
+
+void jitRun(CallFrame* frame);
+
+void jitFree(ObjFunction* function);
+
+#endif
+
+#endif //CLOX_JIT_H
@@ -0,0 +1,563 @@
+#include "common.h"
+
+#ifdef CLOX_BYTECODE_CACHE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "loxc.h"
+#include "memory.h"
+#include "vm.h"
+
+// a .loxc file, in the byte order of the machine that wrote it:
+//   header    "LOXC", version, opcode count, value layout (u32 each), source hash, source length (u64 each)
+//   globals   u32 count, then a u32 length and the bytes of each global name, in slot order
+//   function  the script, below
+// a function is its arity, upvalue count, name length (-1 for the script) and name, its constants (u32 count, then
+// a tag and the value of each, nested functions in place), its cache and loop counts, and its code: a u32 size, the
+// bytes, padding to a multiple of 4 from the start of the file and an int32 line for every byte
+
+#define LOXC_MAGIC "LOXC"
+// the opcodes this build knows, a file written by a build with more or fewer of them is stale
+#define OPCODE_COUNT (OP_GREATER_NUM + 1)
+#ifdef NAN_BOXING
+#define VALUE_LAYOUT (sizeof(Value) | 0x100)
+#else
+#define VALUE_LAYOUT sizeof(Value)
+#endif
+
+// the kinds of constants the compiler puts in a chunk
+typedef enum
+{
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+// a .loxc file being written, a plain allocation so the GC can't run while the functions are walked
+typedef struct
+{
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+// a cursor over a mapped .loxc file, every read checks the end of the file
+typedef struct
+{
+    uint8_t* base;
+    uint8_t* current;
+    uint8_t* end;
+} Reader;
+
+/// 64-bit FNV-1a hash of the source, stored in the file to tell whether the script changed since it was cached
+static uint64_t hashSource(const char* source, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/// the cache path of a script, the source path with a "c" appended to a .lox extension or ".loxc" to any other
+/// @param sourcePath the script's path
+/// @param path       an output buffer for the cache path
+/// @param size       the buffer's size
+void loxcPath(const char* sourcePath, char* path, size_t size)
+{
+    size_t length = strlen(sourcePath);
+    bool lox = length >= 4 && strcmp(sourcePath + length - 4, ".lox") == 0;
+    snprintf(path, size, "%s%s", sourcePath, lox ? "c" : ".loxc");
+}
+
+////////////////////////////////////////////// writing
+
+/// appends bytes to the buffer
+static void writeBytes(Buffer* buffer, const void* bytes, size_t count)
+{
+    if (buffer->count + count > buffer->capacity)
+    {
+        while (buffer->count + count > buffer->capacity) buffer->capacity = GROW_CAPACITY(buffer->capacity);
+        buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+        if (buffer->bytes == NULL) exit(1);
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+static void writeU32(Buffer* buffer, uint32_t value)
+{
+    writeBytes(buffer, &value, sizeof(value));
+}
+
+static void writeString(Buffer* buffer, ObjString* string)
+{
+    writeU32(buffer, (uint32_t)string->length);
+    writeBytes(buffer, string->chars, string->length);
+}
+
+/// appends a function and the functions in its constants
+/// @return false if a constant has a kind the format can't hold
+static bool writeFunction(Buffer* buffer, ObjFunction* function)
+{
+    writeU32(buffer, (uint32_t)function->arity);
+    writeU32(buffer, (uint32_t)function->upvalueCount);
+    if (function->name == NULL) writeU32(buffer, UINT32_MAX);
+    else writeString(buffer, function->name);
+
+    Chunk* chunk = &function->chunk;
+    writeU32(buffer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        uint8_t tag;
+        if (IS_NUMBER(constant))
+        {
+            tag = CONSTANT_NUMBER;
+            double number = AS_NUMBER(constant);
+            writeBytes(buffer, &tag, 1);
+            writeBytes(buffer, &number, sizeof(number));
+        }
+        else if (IS_STRING(constant))
+        {
+            tag = CONSTANT_STRING;
+            writeBytes(buffer, &tag, 1);
+            writeString(buffer, AS_STRING(constant));
+        }
+        else if (IS_FUNCTION(constant))
+        {
+            tag = CONSTANT_FUNCTION;
+            writeBytes(buffer, &tag, 1);
+            if (!writeFunction(buffer, AS_FUNCTION(constant))) return false;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    writeU32(buffer, (uint32_t)chunk->cacheCount);
+    writeU32(buffer, (uint32_t)chunk->loopCount);
+    writeU32(buffer, (uint32_t)chunk->count);
+    writeBytes(buffer, chunk->code, chunk->count);
+    static const uint8_t padding[4] = {0};
+    writeBytes(buffer, padding, (4 - buffer->count % 4) % 4);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        int32_t line = chunk->lines[i];
+        writeBytes(buffer, &line, sizeof(line));
+    }
+    return true;
+}
+
+/// caches a freshly compiled script. the file is written under a temporary name and renamed into place, so a
+/// concurrent run never maps half of it
+/// @param path   the cache path
+/// @param source the script's source
+/// @param script the script's top level function, before it ran
+/// @return       false if the file couldn't be written
+bool writeLoxc(const char* path, const char* source, ObjFunction* script)
+{
+    Buffer buffer = {NULL, 0, 0};
+    size_t length = strlen(source);
+    uint64_t hash = hashSource(source, length);
+    uint64_t sourceLength = length;
+
+    writeBytes(&buffer, LOXC_MAGIC, 4);
+    writeU32(&buffer, LOXC_VERSION);
+    writeU32(&buffer, OPCODE_COUNT);
+    writeU32(&buffer, VALUE_LAYOUT);
+    writeBytes(&buffer, &hash, sizeof(hash));
+    writeBytes(&buffer, &sourceLength, sizeof(sourceLength));
+
+    writeU32(&buffer, (uint32_t)vm.globalNames.count);
+    for (int i = 0; i < vm.globalNames.count; i++) writeString(&buffer, AS_STRING(vm.globalNames.values[i]));
+
+    bool written = writeFunction(&buffer, script);
+    if (written)
+    {
+        char temporary[4096];
+        snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid());
+        FILE* file = fopen(temporary, "wb");
+        written = file != NULL;
+        if (written)
+        {
+            written = fwrite(buffer.bytes, 1, buffer.count, file) == buffer.count;
+            written = fclose(file) == 0 && written;
+            written = written && rename(temporary, path) == 0;
+            if (!written) remove(temporary);
+        }
+    }
+    free(buffer.bytes);
+    return written;
+}
+
+////////////////////////////////////////////// verifying
+
+/// @return a pointer to the next `count` bytes and moves past them, NULL if the file ends first
+static uint8_t* take(Reader* reader, size_t count)
+{
+    if ((size_t)(reader->end - reader->current) < count) return NULL;
+    uint8_t* bytes = reader->current;
+    reader->current += count;
+    return bytes;
+}
+
+static bool readU32(Reader* reader, uint32_t* value)
+{
+    uint8_t* bytes = take(reader, sizeof(*value));
+    if (bytes != NULL) memcpy(value, bytes, sizeof(*value));
+    return bytes != NULL;
+}
+
+/// moves past the padding before a function's line table
+static bool alignLines(Reader* reader)
+{
+    size_t offset = (size_t)(reader->current - reader->base);
+    return take(reader, (4 - offset % 4) % 4) != NULL;
+}
+
+/// @return false if the constant isn't there or isn't a string
+static bool isString(const uint8_t* tags, uint32_t count, uint32_t index)
+{
+    return index < count && tags[index] == CONSTANT_STRING;
+}
+
+/// checks a function's bytecode: every opcode is known, every operand is in range for the function's constants,
+/// upvalues, caches, loops and the script's globals, every jump lands on an instruction, and the code can't run off
+/// its end
+static bool verifyCode(const uint8_t* code, uint32_t count, const uint8_t* tags, const uint32_t* upvalues,
+                       uint32_t constantCount, uint32_t upvalueCount, uint32_t cacheCount, uint32_t loopCount,
+                       uint32_t globalCount)
+{
+    if (count == 0 || code[count - 1] != OP_RETURN) return false;
+
+    // starts[i] marks instruction boundaries, targets[i] the jumps that land on offset i
+    bool* starts = calloc(count, sizeof(bool));
+    bool* targets = calloc(count, sizeof(bool));
+    if (starts == NULL || targets == NULL) exit(1);
+
+    bool valid = true;
+    uint32_t offset = 0;
+    while (valid && offset < count)
+    {
+        const uint8_t* ip = &code[offset];
+        uint32_t length = 1;
+        starts[offset] = true;
+        switch (ip[0])
+        {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            length = 2;
+            break;
+        case OP_CONSTANT:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_LESS_CONSTANT:
+            length = 2;
+            valid = offset + 1 < count && ip[1] < constantCount;
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            length = 2;
+            valid = offset + 1 < count && ip[1] < upvalueCount;
+            break;
+        case OP_CLASS:
+        case OP_METHOD:
+            length = 2;
+            valid = offset + 1 < count && isString(tags, constantCount, ip[1]);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            length = 3;
+            valid = offset + 2 < count && (uint32_t)(ip[1] << 8 | ip[2]) < globalCount;
+            break;
+        case OP_ADD_LOCALS:
+            length = 3;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+            {
+                length = 3;
+                valid = offset + 2 < count;
+                uint32_t target = valid ? offset + 3 + (uint32_t)(ip[1] << 8 | ip[2]) : count;
+                valid = valid && target < count;
+                if (valid) targets[target] = true;
+                break;
+            }
+        case OP_LOOP:
+            {
+                length = 5;
+                valid = offset + 4 < count && (uint32_t)(ip[1] << 8 | ip[2]) <= offset + 5 &&
+                    (uint32_t)(ip[3] << 8 | ip[4]) < loopCount;
+                uint32_t target = valid ? offset + 5 - (uint32_t)(ip[1] << 8 | ip[2]) : count;
+                valid = valid && target < count;
+                if (valid) targets[target] = true;
+                break;
+            }
+        case OP_CONSTANT_LONG:
+            length = 4;
+            valid = offset + 3 < count && ((uint32_t)ip[3] << 16 | (uint32_t)ip[2] << 8 | ip[1]) < constantCount;
+            break;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+            length = 4;
+            valid = offset + 3 < count && isString(tags, constantCount, ip[1]) &&
+                (uint32_t)(ip[2] << 8 | ip[3]) < cacheCount;
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            length = 5;
+            valid = offset + 4 < count && isString(tags, constantCount, ip[1]) &&
+                (uint32_t)(ip[3] << 8 | ip[4]) < cacheCount;
+            break;
+        case OP_CLOSURE:
+            {
+                valid = offset + 1 < count && ip[1] < constantCount && tags[ip[1]] == CONSTANT_FUNCTION;
+                if (!valid) break;
+                uint32_t captured = upvalues[ip[1]];
+                length = 2 + 2 * captured;
+                valid = offset + length <= count;
+                for (uint32_t i = 0; valid && i < captured; i++)
+                {
+                    uint8_t isLocal = ip[2 + 2 * i];
+                    valid = isLocal == 1 || (isLocal == 0 && ip[3 + 2 * i] < upvalueCount);
+                }
+                break;
+            }
+        default:
+            valid = ip[0] < OPCODE_COUNT;
+            break;
+        }
+        valid = valid && offset + length <= count;
+        offset += length;
+    }
+
+    for (uint32_t i = 0; valid && i < count; i++) valid = !targets[i] || starts[i];
+    free(starts);
+    free(targets);
+    return valid;
+}
+
+/// checks a function and the functions in its constants without allocating any objects
+/// @param reader       the cursor, left after the function
+/// @param globalCount  the number of global slots the file declares
+/// @param depth        how deep the function is nested
+/// @param upvalueCount an output parameter for the function's upvalue count, for the OP_CLOSURE that creates it
+/// @return             false if the function is malformed
+static bool verifyFunction(Reader* reader, uint32_t globalCount, int depth, uint32_t* upvalueCount)
+{
+    uint32_t arity, nameLength, constantCount;
+    if (depth > LOXC_MAX_DEPTH || !readU32(reader, &arity) || arity > UINT8_MAX ||
+        !readU32(reader, upvalueCount) || *upvalueCount > UINT8_COUNT || !readU32(reader, &nameLength) ||
+        (nameLength != UINT32_MAX && take(reader, nameLength) == NULL) || !readU32(reader, &constantCount))
+    {
+        return false;
+    }
+    // a constant takes at least its tag byte, which bounds the allocations below by the file size
+    if (constantCount > (size_t)(reader->end - reader->current)) return false;
+
+    uint8_t* tags = malloc(constantCount + 1);
+    uint32_t* upvalues = malloc(sizeof(uint32_t) * (constantCount + 1));
+    if (tags == NULL || upvalues == NULL) exit(1);
+
+    bool valid = true;
+    for (uint32_t i = 0; valid && i < constantCount; i++)
+    {
+        uint8_t* tag = take(reader, 1);
+        uint32_t length;
+        valid = tag != NULL;
+        if (!valid) break;
+        tags[i] = *tag;
+        switch (*tag)
+        {
+        case CONSTANT_NUMBER:
+            valid = take(reader, sizeof(double)) != NULL;
+            break;
+        case CONSTANT_STRING:
+            valid = readU32(reader, &length) && take(reader, length) != NULL;
+            break;
+        case CONSTANT_FUNCTION:
+            valid = verifyFunction(reader, globalCount, depth + 1, &upvalues[i]);
+            break;
+        default:
+            valid = false;
+            break;
+        }
+    }
+
+    uint32_t cacheCount, loopCount, codeCount;
+    uint8_t* code = NULL;
+    valid = valid && readU32(reader, &cacheCount) && cacheCount <= UINT16_MAX + 1 && readU32(reader, &loopCount) &&
+        loopCount <= UINT16_MAX + 1 && readU32(reader, &codeCount) && codeCount <= INT32_MAX / 4 &&
+        (code = take(reader, codeCount)) != NULL && alignLines(reader) &&
+        take(reader, sizeof(int32_t) * codeCount) != NULL &&
+        verifyCode(code, codeCount, tags, upvalues, constantCount, *upvalueCount, cacheCount, loopCount, globalCount);
+    free(tags);
+    free(upvalues);
+    return valid;
+}
+
+/// checks a whole mapped file: the header matches this build and the source, and the globals and functions are
+/// well formed and fill the file exactly
+/// @param reader      the cursor, left at the global names
+/// @param source      the script's source
+/// @param globalCount an output parameter for the number of globals
+static bool verifyFile(Reader* reader, const char* source, uint32_t* globalCount)
+{
+    uint8_t* magic = take(reader, 4);
+    uint32_t version, opcodeCount, layout;
+    uint64_t hash, sourceLength;
+    size_t length = strlen(source);
+    if (magic == NULL || memcmp(magic, LOXC_MAGIC, 4) != 0 || !readU32(reader, &version) ||
+        version != LOXC_VERSION || !readU32(reader, &opcodeCount) || opcodeCount != OPCODE_COUNT ||
+        !readU32(reader, &layout) || layout != VALUE_LAYOUT || take(reader, sizeof(hash)) == NULL ||
+        take(reader, sizeof(sourceLength)) == NULL)
+    {
+        return false;
+    }
+    memcpy(&hash, reader->current - sizeof(sourceLength) - sizeof(hash), sizeof(hash));
+    memcpy(&sourceLength, reader->current - sizeof(sourceLength), sizeof(sourceLength));
+    if (sourceLength != length || hash != hashSource(source, length)) return false;
+
+    if (!readU32(reader, globalCount) || *globalCount > UINT16_MAX + 1) return false;
+    Reader functions = *reader;
+    for (uint32_t i = 0; i < *globalCount; i++)
+    {
+        uint32_t nameLength;
+        if (!readU32(&functions, &nameLength) || take(&functions, nameLength) == NULL) return false;
+    }
+
+    uint32_t upvalueCount;
+    return verifyFunction(&functions, *globalCount, 0, &upvalueCount) && upvalueCount == 0 &&
+        functions.current == functions.end;
+}
+
+////////////////////////////////////////////// loading
+
+static uint32_t loadU32(Reader* reader)
+{
+    uint32_t value;
+    readU32(reader, &value);
+    return value;
+}
+
+/// reads a string the verifier has checked and interns it
+static ObjString* loadString(Reader* reader, uint32_t length)
+{
+    return copyString((const char*)take(reader, length), (int)length);
+}
+
+/// builds a verified function. its code and lines stay in the mapping, the function is kept on the stack while
+/// its constants are allocated
+static ObjFunction* loadFunction(Reader* reader)
+{
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    function->arity = (int)loadU32(reader);
+    function->upvalueCount = (int)loadU32(reader);
+    uint32_t nameLength = loadU32(reader);
+    if (nameLength != UINT32_MAX) function->name = loadString(reader, nameLength);
+
+    Chunk* chunk = &function->chunk;
+    uint32_t constantCount = loadU32(reader);
+    for (uint32_t i = 0; i < constantCount; i++)
+    {
+        uint8_t tag = *take(reader, 1);
+        if (tag == CONSTANT_NUMBER)
+        {
+            double number;
+            memcpy(&number, take(reader, sizeof(number)), sizeof(number));
+            addConstant(chunk, NUMBER_VAL(number));
+        }
+        else if (tag == CONSTANT_STRING)
+        {
+            addConstant(chunk, OBJ_VAL(loadString(reader, loadU32(reader))));
+        }
+        else
+        {
+            addConstant(chunk, OBJ_VAL(loadFunction(reader)));
+        }
+    }
+
+    uint32_t cacheCount = loadU32(reader);
+    uint32_t loopCount = loadU32(reader);
+    for (uint32_t i = 0; i < cacheCount; i++) addCache(chunk);
+    for (uint32_t i = 0; i < loopCount; i++) addLoop(chunk);
+
+    chunk->count = (int)loadU32(reader);
+    chunk->code = take(reader, chunk->count);
+    alignLines(reader);
+    chunk->lines = (int*)take(reader, sizeof(int32_t) * chunk->count);
+    chunk->mapped = true;
+    pop();
+    return function;
+}
+
+/// loads a script's cached bytecode. the file is mapped and verified before anything is allocated, and the code
+/// and line tables of the functions are used in place
+/// @param path    the cache path
+/// @param source  the script's source, the cache is only used if it was written for this exact source
+/// @param mapping an output parameter for the mapping, which has to outlive the functions' use
+/// @return        the script's top level function, NULL if there's no usable cache
+ObjFunction* loadLoxc(const char* path, const char* source, LoxcMapping* mapping)
+{
+    mapping->base = NULL;
+    mapping->size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    void* base = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+    mapping->base = base;
+    mapping->size = (size_t)info.st_size;
+
+    Reader reader = {mapping->base, mapping->base, mapping->base + mapping->size};
+    uint32_t globalCount;
+    if (!verifyFile(&reader, source, &globalCount))
+    {
+        unmapLoxc(mapping);
+        return NULL;
+    }
+
+    // the globals get the slots the compiler gave them, which holds as long as the natives are the same
+    for (uint32_t i = 0; i < globalCount; i++)
+    {
+        if (globalSlot(loadString(&reader, loadU32(&reader))) != (int)i)
+        {
+            unmapLoxc(mapping);
+            return NULL;
+        }
+    }
+    return loadFunction(&reader);
+}
+
+/// unmaps a .loxc file once nothing runs its code anymore
+void unmapLoxc(LoxcMapping* mapping)
+{
+    if (mapping->base != NULL) munmap(mapping->base, mapping->size);
+    mapping->base = NULL;
+    mapping->size = 0;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef CLOX_LOXC_H
+#define CLOX_LOXC_H
+
+#include "common.h"
+
+#ifdef CLOX_BYTECODE_CACHE
+
+#include "object.h"
+
+// the format of .loxc files, bump it whenever the compiler's output or the file layout changes
+#define LOXC_VERSION 1
+// the deepest function nesting a .loxc file may hold, deeper scripts are compiled every time
+#define LOXC_MAX_DEPTH 128
+
+// a .loxc file mapped into memory. it's mapped private, so the pages are shared between processes until the VM
+// quickens an instruction in them
+typedef struct
+{
+    uint8_t* base;
+    size_t size;
+} LoxcMapping;
+
+void loxcPath(const char* sourcePath, char* path, size_t size);
+
+ObjFunction* loadLoxc(const char* path, const char* source, LoxcMapping* mapping);
+
+bool writeLoxc(const char* path, const char* source, ObjFunction* script);
+
+void unmapLoxc(LoxcMapping* mapping);
+
+#endif
+
+#endif //CLOX_LOXC_H
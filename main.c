@@ -3,8 +3,12 @@
 #include <string.h>
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
 #include "vm.h"
+#include "jit.h"
+#include "aot.h"
+#include "loxc.h"
 
 /// a REPL function for single line arguments
 static void repl()
@@ -66,46 +70,160 @@ static char* readFile(const char* path)
 }
 
 /// the function gets a file path, reads it and interprets it
-/// @param path the file path for the file that needs to be interpreted
-/// @return     will returns exit code if there will be errors (65-for compilation error, 70-for runtime error)
-static char* runFile(const char* path)
+/// @param path  the file path for the file that needs to be interpreted
+/// @param cache whether to load the script's .loxc file when it matches the source, and write it when it doesn't
+/// @return      the exit code (0 - success, 65 - for compilation error, 70 - for runtime error)
+static int runFile(const char* path, bool cache)
 {
     //opens the file and reads it to a dynamically allocated string
     char* source = readFile(path);
 
-    //interprets the file using the string
-    InterpretResult result = interpret(source);
+    InterpretResult result;
+#ifdef CLOX_BYTECODE_CACHE
+    if (cache)
+    {
+        //runs the cached bytecode, or compiles the script and caches it for the next run
+        char cachePath[4096];
+        loxcPath(path, cachePath, sizeof(cachePath));
+        LoxcMapping mapping;
+        ObjFunction* function = loadLoxc(cachePath, source, &mapping);
+        if (function == NULL)
+        {
+            function = compile(source);
+            if (function != NULL) writeLoxc(cachePath, source, function);
+        }
+        result = function == NULL ? INTERPRET_COMPILE_ERROR : interpretFunction(function);
+        //nothing runs the mapped code anymore, the functions' chunks know not to free it
+        unmapLoxc(&mapping);
+    }
+    else
+#else
+    (void)cache;
+#endif
+    {
+        //interprets the file using the string
+        result = interpret(source);
+    }
     //frees the dynamically allocated string
     free(source);
 
-    //exits with the appropriate error code if there was an issue
+    //returns the appropriate error code if there was an issue
     if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
+        return 65;
     if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+        return 70;
+    return 0;
+}
+
+/// the function gets a file path and translates the script to a C program
+/// @param path   the script's path
+/// @param output the path of the C file, NULL writes the program to stdout
+/// @return       the exit code (0 - success, 65 - for compilation error)
+static int emitFile(const char* path, const char* output)
+{
+    char* source = readFile(path);
+    FILE* out = output == NULL ? stdout : fopen(output, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open file %s\n", output);
+        exit(74);
+    }
+
+    bool emitted = emitC(source, out);
+    free(source);
+    if (out != stdout)
+    {
+        fclose(out);
+        //a script that doesn't compile leaves no half written program behind
+        if (!emitted) remove(output);
+    }
+    return emitted ? 0 : 65;
+}
+
+/// prints the command line usage and exits
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--ic-stats] [--no-cache] [--no-jit | --jit-eager] [path]\n       clox --emit-c path [output.c]\n");
+    exit(64);
 }
 
 /// the main function that runs the program
 int main(int argc, const char* argv[])
 {
+    const char* path = NULL;
+    const char* output = NULL;
+    bool icStats = false;
+    bool emit = false;
+    bool cache = true;
+    int jitThreshold = -1; // the JIT and trace thresholds the options asked for, -1 keeps the defaults
+
+    //options start with "--", the first other argument is the script and the second one where --emit-c writes to
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--ic-stats") == 0)
+        {
+            icStats = true;
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0)
+        {
+            emit = true;
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            cache = false;
+        }
+        else if (strcmp(argv[i], "--no-jit") == 0)
+        {
+            jitThreshold = 0;
+        }
+        else if (strcmp(argv[i], "--jit-eager") == 0)
+        {
+            jitThreshold = 1;
+        }
+        else if (strncmp(argv[i], "--", 2) == 0 || output != NULL)
+        {
+            usage();
+        }
+        else if (path != NULL)
+        {
+            output = argv[i];
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+    if ((output != NULL && !emit) || (emit && path == NULL)) usage();
+
     //initializes the VM before injecting the code
     initVM();
+#ifdef CLOX_JIT
+    if (jitThreshold != -1)
+    {
+        vm.jitThreshold = jitThreshold;
+        vm.traceThreshold = jitThreshold;
+    }
+#else
+    (void)jitThreshold;
+#endif
 
-    if (argc == 1)
+    int status = 0;
+    if (emit)
     {
-        repl();
+        status = emitFile(path, output);
     }
-    else if (argc == 2)
+    else if (path == NULL)
     {
-        runFile(argv[1]);
+        repl();
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        status = runFile(path, cache);
     }
 
+    if (icStats) printCacheStats();
+
     //frees all allocated memory!
     freeVM();
-    return 0;
+    return status;
 }
\ No newline at end of file
@@ -4,6 +4,12 @@
 #include "value.h"
 #include "vm.h"
 #include "compiler.h"
+#include "jit.h"
+
+#ifdef CLOX_MMAP_STACKS
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #define GC_HEAP_GROW_FACTOR 2
 
@@ -46,6 +52,38 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
     return result;
 }
 
+/// maps the memory of one of the VM's stacks, followed by an inaccessible guard page so running off its end faults
+/// instead of overwriting whatever comes next. the pages are only backed by memory once they're touched
+/// @param size the requested size in bytes, rounded up to whole pages on return
+/// @return     the start of the stack, NULL if it couldn't be mapped
+void* mapStack(size_t* size)
+{
+#ifdef CLOX_MMAP_STACKS
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *size = (*size + page - 1) / page * page;
+
+    uint8_t* memory = mmap(NULL, *size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+    mprotect(memory + *size, page, PROT_NONE);
+    return memory;
+#else
+    return malloc(*size);
+#endif
+}
+
+/// unmaps a stack mapped by mapStack, together with its guard page
+/// @param memory the start of the stack
+/// @param size   the size mapStack returned
+void unmapStack(void* memory, size_t size)
+{
+    if (memory == NULL) return;
+#ifdef CLOX_MMAP_STACKS
+    munmap(memory, size + (size_t)sysconf(_SC_PAGESIZE));
+#else
+    free(memory);
+#endif
+}
+
 /// marks objects as reachable so they won't get collected by the GC
 /// @param object the object that needs to be marked
 void markObject(Obj* object)
@@ -92,6 +130,23 @@ static void markArray(ValueArray* array)
     }
 }
 
+/// Marks the shapes and methods held by a chunk's inline caches, so a freed shape's address can't be reused by a new
+/// shape that would then hit a stale entry.
+/// @param chunk the chunk whose caches we want to mark
+static void markCaches(Chunk* chunk)
+{
+    for (int i = 0; i < chunk->cacheCount; i++)
+    {
+        InlineCache* cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count; j++)
+        {
+            markObject((Obj*)cache->entries[j].shape);
+            markObject((Obj*)cache->entries[j].transition);
+            markValue(cache->entries[j].method);
+        }
+    }
+}
+
 ///Marks an object and its references as reachable during garbage collection.
 /// @param object The object to blacken
 static void blackenObject(Obj* object)
@@ -122,6 +177,7 @@ static void blackenObject(Obj* object)
             // Mark the class name string.
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
+            markObject((Obj*)klass->rootShape);
             break;
         }
     case OBJ_FUNCTION:
@@ -129,6 +185,7 @@ static void blackenObject(Obj* object)
         ObjFunction* function = (ObjFunction*)object;
         markObject((Obj*)function->name);
         markArray(&function->chunk.constants);
+        markCaches(&function->chunk);
         break;
     case OBJ_UPVALUE:
         // Mark the closed-over value in the upvalue.
@@ -136,10 +193,33 @@ static void blackenObject(Obj* object)
         break;
     case OBJ_INSTANCE:
         {
-            // Mark the instance's class and its fields table.
+            // Mark the instance's class, its shape and its fields.
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject((Obj*)instance->shape);
+            if (instance->shape != NULL)
+            {
+                for (int i = 0; i < instance->shape->fieldCount; i++)
+                {
+                    markValue(instance->fields[i]);
+                }
+            }
+            else
+            {
+                markTable(instance->dictionary);
+            }
+            break;
+        }
+    case OBJ_SHAPE:
+        {
+            // Mark the parent shape, the field names and the child shapes.
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            for (int i = 0; i < shape->fieldCount; i++)
+            {
+                markObject((Obj*)shape->names[i]);
+            }
+            markTable(&shape->transitions);
             break;
         }
     case OBJ_BOUND_METHOD:
@@ -177,6 +257,9 @@ static void freeObject(Obj* object)
     case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
+#ifdef CLOX_JIT
+            jitFree(function);
+#endif
             freeChunk(&function->chunk);
             FREE(ObjFunction, object);
             break;
@@ -208,8 +291,24 @@ static void freeObject(Obj* object)
     case OBJ_INSTANCE:
         {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->fields != instance->inlineFields)
+            {
+                FREE_ARRAY(Value, instance->fields, instance->capacity);
+            }
+            if (instance->dictionary != NULL)
+            {
+                freeTable(instance->dictionary);
+                FREE(Table, instance->dictionary);
+            }
+            reallocate(object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
+            break;
+        }
+    case OBJ_SHAPE:
+        {
+            ObjShape* shape = (ObjShape*)object;
+            FREE_ARRAY(ObjString*, shape->names, shape->fieldCount);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
             break;
         }
     case OBJ_BOUND_METHOD:
@@ -238,8 +337,10 @@ static void markRoots()
         markObject((Obj*)upvalue);
     }
 
-    // marks the globals table for the GC
-    markTable(&vm.globals);
+    // marks the globals for the GC
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
 
     //marks the compiler roots for the GC
     markCompilerRoots();
@@ -27,6 +27,10 @@ void markObject(Obj* object);
 
 void collectGarbage();
 
+void* mapStack(size_t* size);
+
+void unmapStack(void* memory, size_t size);
+
 void freeObjects();
 
 #endif
\ No newline at end of file
@@ -42,6 +42,29 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
     return bound;
 }
 
+/// creates a shape that adds a field to a parent shape
+/// @param parent the shape the new one extends, NULL for a root shape
+/// @param name   the name of the added field, NULL for a root shape
+/// @return       a new shape object
+static ObjShape* newShape(ObjShape* parent, ObjString* name)
+{
+    //a shape has its parent's names plus the new one
+    int fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    ObjString** names = ALLOCATE(ObjString*, fieldCount);
+    if (parent != NULL)
+    {
+        memcpy(names, parent->names, sizeof(ObjString*) * parent->fieldCount);
+        names[fieldCount - 1] = name;
+    }
+
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->names = names;
+    shape->fieldCount = fieldCount;
+    initTable(&shape->transitions);
+    return shape;
+}
+
 /// Creates a new class object and initializes its properties.
 /// @param name The name of the class
 /// @return  The newly created ObjClass object.
@@ -51,9 +74,17 @@ ObjClass* newClass(ObjString* name)
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
 
     klass->name = name;
+    klass->rootShape = NULL;
+    klass->version = 0;
+    klass->instanceFields = 0;
 
     // Initialize the class's method table and retuns it
     initTable(&klass->methods);
+
+    //the class is kept on the stack while its root shape is allocated
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL, NULL);
+    pop();
     return klass;
 }
 
@@ -85,21 +116,150 @@ ObjFunction* newFunction()
     function->arity = 0;
     function->name = NULL;
     function->upvalueCount = 0;
+    function->compiled = NULL;
+#ifdef CLOX_JIT
+    function->callCount = 0;
+    function->jit = NULL;
+#endif
     initChunk(&function->chunk);
     return function;
 }
 
-/// 
-/// @param klass 
-/// @return 
+/// creates an instance of a class, with as many inline field slots as the class's instances have needed so far
+/// @param klass the class of the instance
+/// @return      a new instance with the class's root shape
 ObjInstance* newInstance(ObjClass* klass)
 {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int inlineCapacity = klass->instanceFields;
+    ObjInstance* instance = (ObjInstance*)allocateObject(sizeof(ObjInstance) + sizeof(Value) * inlineCapacity,
+                                                         OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->fields = instance->inlineFields;
+    instance->capacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
+    instance->dictionary = NULL;
     return instance;
 }
 
+/// looks up the slot of a field. field names are interned, so comparing pointers is enough
+/// @param shape the shape of an instance
+/// @param name  the field name
+/// @return      the slot of the field, -1 if the shape doesn't have it
+int shapeLookup(ObjShape* shape, ObjString* name)
+{
+    for (int i = 0; i < shape->fieldCount; i++)
+    {
+        if (shape->names[i] == name) return i;
+    }
+    return -1;
+}
+
+/// finds or creates the child of a shape that adds the given field
+/// @param shape the current shape of an instance
+/// @param name  the name of the field being added
+/// @return      the child shape, NULL if the instance should switch to dictionary mode instead
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name)
+{
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    if (shape->fieldCount >= SHAPE_MAX_FIELDS || shape->transitions.count >= SHAPE_MAX_TRANSITIONS) return NULL;
+
+    //the new shape is kept on the stack until the transition table holds it
+    ObjShape* child = newShape(shape, name);
+    push(OBJ_VAL(child));
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+/// moves the fields of an instance from its slots into its dictionary table
+/// @param instance the instance that leaves shape mode
+static void makeDictionary(ObjInstance* instance)
+{
+    instance->dictionary = ALLOCATE(Table, 1);
+    initTable(instance->dictionary);
+
+    ObjShape* shape = instance->shape;
+    for (int i = 0; i < shape->fieldCount; i++)
+    {
+        tableSet(instance->dictionary, shape->names[i], instance->fields[i]);
+    }
+
+    instance->shape = NULL;
+    if (instance->fields != instance->inlineFields)
+    {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+    }
+    instance->fields = instance->inlineFields;
+    instance->capacity = instance->inlineCapacity;
+}
+
+/// reads a field of an instance
+/// @param instance the instance
+/// @param name     the field name
+/// @param value    an output parameter for the field's value
+/// @return         true if the instance has the field, false otherwise
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value)
+{
+    if (instance->shape == NULL) return tableGet(instance->dictionary, name, value);
+
+    int slot = shapeLookup(instance->shape, name);
+    if (slot == -1) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+/// writes a field of an instance, adding it if the instance doesn't have it yet. may allocate, so the caller has to
+/// keep the instance and the value reachable
+/// @param instance the instance
+/// @param name     the field name
+/// @param value    the new value of the field
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value)
+{
+    if (instance->shape != NULL)
+    {
+        int slot = shapeLookup(instance->shape, name);
+        if (slot != -1)
+        {
+            instance->fields[slot] = value;
+            return;
+        }
+
+        ObjShape* next = shapeTransition(instance->shape, name);
+        if (next != NULL)
+        {
+            slot = next->fieldCount - 1;
+            if (slot >= instance->capacity)
+            {
+                //the slots outgrew the inline ones, move them to a growing heap array
+                int capacity = GROW_CAPACITY(instance->capacity);
+                if (instance->fields == instance->inlineFields)
+                {
+                    Value* fields = ALLOCATE(Value, capacity);
+                    memcpy(fields, instance->inlineFields, sizeof(Value) * instance->capacity);
+                    instance->fields = fields;
+                }
+                else
+                {
+                    instance->fields = GROW_ARRAY(Value, instance->fields, instance->capacity, capacity);
+                }
+                instance->capacity = capacity;
+            }
+
+            instance->fields[slot] = value;
+            instance->shape = next;
+            if (next->fieldCount > instance->klass->instanceFields) instance->klass->instanceFields = next->fieldCount;
+            return;
+        }
+
+        makeDictionary(instance);
+    }
+
+    tableSet(instance->dictionary, name, value);
+}
+
 /// the function gets a pointer to a native C function and converts it to a Lox function
 /// @param function the native C function that needs to be adapted
 /// @return         adds support for a native C function
@@ -241,6 +401,9 @@ void printObject(Value value)
     case OBJ_UPVALUE:
         printf("upvalue");
         break;
+    case OBJ_SHAPE:
+        printf("shape");
+        break;
     case OBJ_BOUND_METHOD:
         printFunction(AS_BOUND_METHOD(value)->method->function);
         break;
@@ -17,6 +17,7 @@
 #define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 
 // A macro to cast a Value to a certain Obj pointer
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
@@ -27,6 +28,11 @@
 #define AS_CLASS(value)         ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_SHAPE(value)         ((ObjShape*)AS_OBJ(value))
+
+// instances with more fields than this, or whose shape has run out of transitions, fall back to a fields table
+#define SHAPE_MAX_FIELDS 32
+#define SHAPE_MAX_TRANSITIONS 8
 
 // A macro to create a Value from an Obj pointer
 typedef enum
@@ -37,6 +43,7 @@ typedef enum
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
@@ -49,6 +56,17 @@ struct Obj
     struct Obj* next;
 };
 
+// what the C body of a function compiled by --emit-c ran into
+typedef enum
+{
+    COMPILED_RETURN,    // the function returned, its result replaced it and its arguments on the stack
+    COMPILED_TAIL_CALL, // a tail call handed the function's frame to the callee, whose body runs next
+    COMPILED_ERROR,     // a runtime error was reported and the stacks were reset
+} CompiledStatus;
+
+// the C body of a function compiled by --emit-c, it runs the top frame
+typedef CompiledStatus (*CompiledFn)(void);
+
 // Functions are implemented as objects in the interpreter, hence an Obj struct for them
 typedef struct
 {
@@ -57,6 +75,11 @@ typedef struct
     int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    CompiledFn compiled; // the function's body in a program built by --emit-c, NULL when it's interpreted
+#ifdef CLOX_JIT
+    int callCount;       // counts the calls up to the JIT threshold and stops there
+    struct JitCode* jit; // the function's machine code once it's hot, NULL until then or if it can't be compiled
+#endif
 } ObjFunction;
 
 // A native function is a function that is implemented in C
@@ -97,20 +120,41 @@ typedef struct
     int upvalueCount;
 } ObjClosure;
 
+// A shape object
+// A shape maps the field names of an instance to slots in its field array. the shapes of a class form a tree, rooted at
+// an empty shape, where each child adds one field to its parent. instances that add the same fields in the same order
+// end up sharing a shape.
+typedef struct ObjShape
+{
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString** names; // the field names by slot, the last one is the field this shape adds to its parent
+    int fieldCount;
+    Table transitions; // the child shapes, keyed by the name of the field they add
+} ObjShape;
+
 // A class object
 typedef struct
 {
     Obj obj;
     ObjString* name;
     Table methods;
+    ObjShape* rootShape;
+    int version;        // bumped whenever the method table changes, cached methods of an older version are stale
+    int instanceFields; // the most fields an instance of the class has had, used to size the inline slots of new instances
 } ObjClass;
 
 // An instance object
 typedef struct
 {
-    Obj* obj;
+    Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;   // NULL once the instance is in dictionary mode
+    Value* fields;     // the field slots, points at inlineFields until they run out
+    int capacity;
+    int inlineCapacity;
+    Table* dictionary; // the fields of a dictionary-mode instance, NULL in shape mode
+    Value inlineFields[];
 } ObjInstance;
 
 // A bound method object
@@ -131,6 +175,12 @@ ObjFunction* newFunction();
 
 ObjInstance* newInstance(ObjClass* klass);
 
+int shapeLookup(ObjShape* shape, ObjString* name);
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+
 ObjUpvalue* newUpvalue(Value* slot);
 
 ObjNative* newNative(NativeFn function);
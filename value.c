@@ -75,6 +75,8 @@ void printValue(Value value)
     case VAL_OBJ:
         printObject(value);
         break;
+    case VAL_UNDEFINED:
+        break;
     }
     #endif
 }
@@ -105,6 +107,8 @@ bool valuesEqual(Value a, Value b)
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
         return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_UNDEFINED:
+        return true;
     default:
         return false; //unreachable
     }
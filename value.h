@@ -21,6 +21,7 @@ typedef struct ObjString ObjString;
 #define TAG_NIL     1      //01.
 #define TAG_FALSE   2      //10.
 #define TAG_TRUE    3      //11.
+#define TAG_UNDEFINED 4    //100, marks global slots that have no value yet and never reaches Lox code
 
 typedef uint64_t Value;
 
@@ -29,6 +30,7 @@ typedef uint64_t Value;
 #define IS_NIL(value)      ((value) == NIL_VAL)
 #define IS_NUMBER(value)   (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)      ((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 //macros to cast teh NaN value
 #define AS_BOOL(value)     ((value) == TRUE_VAL)
@@ -41,6 +43,7 @@ typedef uint64_t Value;
 #define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NUMBER_VAL(num)     numToValue(num)
 #define NIL_VAL             ((Value)(uint64_t)(QNAN|TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN|TAG_UNDEFINED))
 #define OBJ_VAL(obj)        ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
 
 static inline double valueToNum(Value value)
@@ -65,6 +68,7 @@ typedef enum
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED, // marks global slots that have no value yet, never reaches Lox code
 } ValueType;
 
 typedef struct
@@ -83,6 +87,7 @@ typedef struct
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
@@ -92,6 +97,7 @@ typedef struct
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER,{.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ,{.obj = (Obj*)object}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
@@ -1,12 +1,19 @@
 #include <stdarg.h>
 #include "common.h"
+#ifdef CLOX_MMAP_STACKS
+#include <signal.h>
+#include <unistd.h>
+#endif
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "object.h"
 #include "memory.h"
+#include "jit.h"
+#include "aot.h"
 
 VM vm;
 
@@ -27,6 +34,90 @@ static void resetStack()
     vm.openUpvalues = NULL;
 }
 
+/// maps the initial value and frame stacks
+static void initStacks()
+{
+    vm.stackSize = sizeof(Value) * STACK_INITIAL;
+    vm.stack = mapStack(&vm.stackSize);
+    vm.framesSize = sizeof(CallFrame) * FRAMES_INITIAL;
+    vm.frames = mapStack(&vm.framesSize);
+    if (vm.stack == NULL || vm.frames == NULL)
+    {
+        fprintf(stderr, "Could not allocate the VM stacks.\n");
+        exit(1);
+    }
+
+    vm.stackLimit = vm.stack + vm.stackSize / sizeof(Value);
+    vm.frameCapacity = (int)(vm.framesSize / sizeof(CallFrame));
+}
+
+/// doubles the value stack, moving its contents and every pointer into it (the frames' slots, the open upvalues and
+/// the stack top) to the new mapping
+/// @return true if the stack grew, false if there was no memory for it
+static bool growStack()
+{
+    size_t size = vm.stackSize * 2;
+    Value* stack = mapStack(&size);
+    if (stack == NULL) return false;
+
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+    unmapStack(vm.stack, vm.stackSize);
+    vm.stack = stack;
+    vm.stackSize = size;
+    vm.stackLimit = stack + size / sizeof(Value);
+    return true;
+}
+
+/// doubles the frame stack. frames are only referenced by index outside of run(), which reloads its frame after a call
+/// @return true if the stack grew, false if there was no memory for it
+static bool growFrames()
+{
+    size_t size = vm.framesSize * 2;
+    CallFrame* frames = mapStack(&size);
+    if (frames == NULL) return false;
+
+    memcpy(frames, vm.frames, sizeof(CallFrame) * vm.frameCount);
+    unmapStack(vm.frames, vm.framesSize);
+    vm.frames = frames;
+    vm.framesSize = size;
+    vm.frameCapacity = (int)(size / sizeof(CallFrame));
+    return true;
+}
+
+#ifdef CLOX_MMAP_STACKS
+/// reports a write into the value stack's guard page as a stack overflow. that only happens when a function uses more
+/// than STACK_HEADROOM slots, other faults get the default action
+/// @param signal  the signal number
+/// @param info    the faulting address
+/// @param context unused
+static void guardPageHandler(int signal, siginfo_t* info, void* context)
+{
+    uint8_t* address = info->si_addr;
+    uint8_t* guard = (uint8_t*)vm.stackLimit;
+    if (address >= guard && address < guard + sysconf(_SC_PAGESIZE))
+    {
+        static const char message[] = "Stack overflow.\n";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+        _exit(70);
+    }
+
+    //returning retries the faulting access, which now crashes as usual
+    struct sigaction action = {0};
+    action.sa_handler = SIG_DFL;
+    sigaction(signal, &action, NULL);
+}
+#endif
+
 ///  prints the line where the script had a runtime error
 /// @param format
 /// @param ... a va_list of parameters
@@ -46,6 +137,13 @@ static void runtimeError(const char* format, ...)
     // Iterate through the active call frames in the VM to print the call stack.
     for (int i = vm.frameCount - 1; i >= 0; i--)
     {
+        // deep stacks only show the innermost and outermost frames
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES)
+        {
+            fprintf(stderr, "[... %d more frames]\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES - 1;
+        }
+
         // Get the current call frame.
         CallFrame* frame = &vm.frames[i];
 
@@ -80,10 +178,11 @@ static void defineNative(const char* name, NativeFn function)
     push(OBJ_VAL(copyString(name, (int) strlen(name))));
     push(OBJ_VAL(newNative(function)));
 
-    // Store the function in the global table, associating it with the name.
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    // Store the function in the name's global slot.
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
 
-    //pop the function and his name out of the stack, as they have been stored in the globals table
+    //pop the function and his name out of the stack, as they have been stored in the globals
     pop();
     pop();
 }
@@ -91,7 +190,16 @@ static void defineNative(const char* name, NativeFn function)
 /// initializes the VM
 void initVM()
 {
+    initStacks();
     resetStack();
+
+#ifdef CLOX_MMAP_STACKS
+    struct sigaction action = {0};
+    action.sa_sigaction = guardPageHandler;
+    action.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+#endif
     vm.objects = NULL;
 
     //initializes the number,capacity and stack pointer of gray objects
@@ -100,25 +208,76 @@ void initVM()
     vm.grayStack = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.propertyCacheStats = (CacheStats){0};
+    vm.invokeCacheStats = (CacheStats){0};
+#ifdef CLOX_JIT
+    vm.jitThreshold = JIT_THRESHOLD;
+    vm.traceThreshold = TRACE_THRESHOLD;
+#endif
 
     initTable(&vm.strings);
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
 
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
 
     defineNative("clock", clockNative);
 }
 
+/// prints the counters of one kind of inline cache
+/// @param kind  the label of the line
+/// @param stats the counters
+static void printCacheLine(const char* kind, CacheStats* stats)
+{
+    uint64_t total = stats->hits + stats->misses;
+    fprintf(stderr, "%s: %llu hits, %llu misses (%.1f%% hit rate), %d polymorphic, %d megamorphic\n", kind,
+            (unsigned long long)stats->hits, (unsigned long long)stats->misses,
+            total == 0 ? 0.0 : 100.0 * (double)stats->hits / (double)total, stats->polymorphic, stats->megamorphic);
+}
+
+/// prints the inline cache counters of the run to stderr
+void printCacheStats()
+{
+    printCacheLine("property caches", &vm.propertyCacheStats);
+    printCacheLine("invoke caches", &vm.invokeCacheStats);
+}
+
+/// returns the slot of a global variable, handing the name the next free slot the first time it is seen
+/// @param name the variable name
+/// @return     the index of the variable in vm.globalValues
+int globalSlot(ObjString* name)
+{
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    //the name is kept on the stack while the tables grow
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL((double)(vm.globalValues.count - 1)));
+    pop();
+    return vm.globalValues.count - 1;
+}
+
 /// frees the VM
 void freeVM()
 {
     freeTable(&vm.strings);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
     vm.initString = NULL;
+    unmapStack(vm.stack, vm.stackSize);
+    unmapStack(vm.frames, vm.framesSize);
+    vm.stack = NULL;
+    vm.frames = NULL;
     freeObjects();
 }
 
-/// pushes a value onto the VM stack
+/// pushes a value onto the VM stack. calls leave STACK_HEADROOM free slots for this, and pushing past the end of the
+/// stack hits its guard page
 /// @param val the value that needs to be pushed
 void push(Value val)
 {
@@ -142,6 +301,17 @@ static Value peek(int distance)
     return vm.stackTop[-1 - distance];
 }
 
+/// counts a call to a function, compiling it to machine code on the call that reaches the JIT threshold
+/// @param function the called function
+static inline void countCall(ObjFunction* function)
+{
+#ifdef CLOX_JIT
+    if (function->callCount < vm.jitThreshold && ++function->callCount == vm.jitThreshold) jitCompile(function);
+#else
+    (void)function;
+#endif
+}
+
 /// Calls a function closure with the specified argument count.
 /// @param closure The function closure to be called
 /// @param argCount The number of arguments passed to the closure.
@@ -155,8 +325,10 @@ static bool call(ObjClosure* closure, int argCount)
         return false;
     }
 
-    // checks if the stack has enough space for the new frame
-    if (vm.frameCount == FRAMES_MAX)
+    // checks if the stacks have enough space for the new frame, growing them if needed
+    if (vm.frameCount == FRAMES_MAX ||
+        (vm.frameCount == vm.frameCapacity && !growFrames()) ||
+        (vm.stackLimit - vm.stackTop < STACK_HEADROOM && !growStack()))
     {
         runtimeError("Stack overflow.");
         return false;
@@ -167,6 +339,7 @@ static bool call(ObjClosure* closure, int argCount)
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+    countCall(closure->function);
     return true;
 }
 
@@ -237,11 +410,55 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
     return call(AS_CLOSURE(method), argCount);
 }
 
+/// finds the entry of an inline cache that was filled for a receiver shape
+/// @param cache   the inline cache of the instruction
+/// @param shape   the receiver's shape, NULL for dictionary-mode instances which are never cached
+/// @param version the current version of the receiver class's method table
+/// @return        the matching entry, NULL on a miss
+static inline CacheEntry* findCacheEntry(InlineCache* cache, ObjShape* shape, int version)
+{
+    for (int i = 0; i < cache->count; i++)
+    {
+        if (cache->entries[i].shape == shape && cache->entries[i].version == version) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+/// records a resolved property in an inline cache, replacing a stale entry for the same shape. once a cache would
+/// need more than CACHE_WAYS entries it is emptied and marked megamorphic, and its instruction stops caching
+/// @param cache the inline cache of the instruction
+/// @param stats the counters of the cache's kind
+/// @param entry the resolved property
+static void updateCache(InlineCache* cache, CacheStats* stats, CacheEntry entry)
+{
+    if (cache->megamorphic) return;
+
+    for (int i = 0; i < cache->count; i++)
+    {
+        if (cache->entries[i].shape == entry.shape)
+        {
+            cache->entries[i] = entry;
+            return;
+        }
+    }
+
+    if (cache->count == CACHE_WAYS)
+    {
+        cache->megamorphic = true;
+        cache->count = 0;
+        stats->megamorphic++;
+        return;
+    }
+    if (cache->count == 1) stats->polymorphic++;
+
+    cache->entries[cache->count++] = entry;
+}
+
 ///Invoke a method on an instance by looking it up in the class and executing it
 /// @param name The name of the method to invoke
 /// @param argCount The number of arguments passed to the method
 /// @return True if the method was successfully invoked, false otherwise.
-static bool invoke(ObjString* name, int argCount)
+static bool invoke(ObjString* name, int argCount, InlineCache* cache)
 {
     Value receiver = peek(argCount);
 
@@ -252,16 +469,49 @@ static bool invoke(ObjString* name, int argCount)
     }
 
     ObjInstance* instance = AS_INSTANCE(receiver);
+    ObjShape* shape = instance->shape;
+    ObjClass* klass = instance->klass;
 
     Value value;
 
-    if (tableGet(&instance->fields, name, &value))
+    if (instanceGetField(instance, name, &value))
     {
+        if (shape != NULL)
+        {
+            updateCache(cache, &vm.invokeCacheStats,
+                        (CacheEntry){.shape = shape, .slot = shapeLookup(shape, name), .version = klass->version});
+        }
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    if (shape != NULL && tableGet(&klass->methods, name, &value))
+    {
+        updateCache(cache, &vm.invokeCacheStats,
+                    (CacheEntry){.shape = shape, .slot = -1, .method = value, .version = klass->version});
+    }
+    return invokeFromClass(klass, name, argCount);
+}
+
+/// looks up a method in the superclass for OP_GET_SUPER and OP_SUPER_INVOKE and caches it for the site. the superclass
+/// is fixed once the class is defined, so the cache is keyed on it (through its root shape) instead of the receiver
+/// @param superclass the superclass of the class the method was defined in
+/// @param name       the method name
+/// @param cache      the inline cache of the instruction
+/// @param method     an output parameter for the method's closure
+/// @return           true if the method was found, false after reporting a runtime error
+static bool findSuperMethod(ObjClass* superclass, ObjString* name, InlineCache* cache, Value* method)
+{
+    if (!tableGet(&superclass->methods, name, method))
+    {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    updateCache(cache, &vm.invokeCacheStats, (CacheEntry){
+                    .shape = superclass->rootShape, .slot = -1, .method = *method, .version = superclass->version
+                });
+    return true;
 }
 
 /// the function gets a class and a method name and binds it
@@ -284,6 +534,60 @@ static bool bindMethod(ObjClass* klass, ObjString* name)
     return true;
 }
 
+/// the slow path of OP_GET_PROPERTY, replaces the instance on top of the stack with the property's value and fills
+/// the instruction's cache
+/// @param instance the receiver
+/// @param name     the property name
+/// @param cache    the inline cache of the instruction
+/// @return         true if the property was found, false after reporting a runtime error
+static bool getProperty(ObjInstance* instance, ObjString* name, InlineCache* cache)
+{
+    ObjShape* shape = instance->shape;
+    Value value;
+
+    // Try to get the property value from the instance's fields.
+    if (instanceGetField(instance, name, &value))
+    {
+        if (shape != NULL)
+        {
+            updateCache(cache, &vm.propertyCacheStats, (CacheEntry){
+                            .shape = shape, .slot = shapeLookup(shape, name), .version = instance->klass->version
+                        });
+        }
+        pop();
+        push(value);
+        return true;
+    }
+
+    // If the property doesn't exist in the instance's fields, try binding a method from the class.
+    if (shape != NULL && tableGet(&instance->klass->methods, name, &value))
+    {
+        updateCache(cache, &vm.propertyCacheStats, (CacheEntry){
+                        .shape = shape, .slot = -1, .method = value, .version = instance->klass->version
+                    });
+    }
+    return bindMethod(instance->klass, name);
+}
+
+/// the slow path of OP_SET_PROPERTY, stores the field and fills the instruction's cache
+/// @param instance the receiver
+/// @param name     the field name
+/// @param value    the assigned value, has to be on the stack since adding a field can allocate
+/// @param cache    the inline cache of the instruction
+static void setProperty(ObjInstance* instance, ObjString* name, Value value, InlineCache* cache)
+{
+    ObjShape* shape = instance->shape;
+    instanceSetField(instance, name, value);
+
+    if (shape != NULL && instance->shape != NULL)
+    {
+        updateCache(cache, &vm.propertyCacheStats, (CacheEntry){
+                        .shape = shape, .transition = instance->shape == shape ? NULL : instance->shape,
+                        .slot = shapeLookup(instance->shape, name), .version = instance->klass->version
+                    });
+    }
+}
+
 /// Captures a local variable as an upvalue, allowing it to be closed over by a closure.
 /// @param local The local variable (in the stack) to be captured as an upvalue.
 /// @return      an upvalue representing the captured local variable
@@ -344,6 +648,7 @@ static void defineMethod(ObjString* name)
 
     //stores the method in the class's method table using the provided name.
     tableSet(&klass->methods, name, method);
+    klass->version++;
     pop();
 }
 
@@ -373,31 +678,25 @@ static void concatenate()
     push(OBJ_VAL(result));
 }
 
-/// a helper function that executes the bytecode by iterating through the chunk one bytecode at a time
-/// @return returns an interpreted result
-static InterpretResult run()
+/// the slow path of OP_ADD for anything but two numbers, works on the spilled stack
+/// @return true if the operands were concatenated, false (after reporting the error) otherwise
+static bool addNonNumbers()
 {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_CONSTANT_LONG(arr)  (frame->closure->function->chunk.constants.values[(uint32_t)arr[2] << 16 | (uint16_t)arr[1] << 8 | arr[0]])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_SHORT() ((frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1])))
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+    {
+        concatenate();
+        return true;
+    }
 
-    //a macro to perform binary operations
-#define BINARY_OP(valueType, op) \
-do { \
-if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-runtimeError("Operands must be numbers."); \
-return INTERPRET_RUNTIME_ERROR; \
-} \
-double b = AS_NUMBER(pop()); \
-double a = AS_NUMBER(pop()); \
-push(valueType(a op b)); \
-} while (false)
+    runtimeError("Operands must be 2 numbers or 2 strings.");
+    return false;
+}
 
-    //a check for a debug flag that if present prints the trace
 #ifdef DEBUG_TRACE_EXECUTION
+/// prints the stack and the instruction that is about to be executed
+/// @param frame the current call frame
+static void traceExecution(CallFrame* frame)
+{
     printf("          ");
     for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
     {
@@ -407,231 +706,524 @@ push(valueType(a op b)); \
     }
     printf("\n");
     disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+}
+#endif
+
+/// a helper function that executes the bytecode by iterating through the chunk one bytecode at a time
+/// @return returns an interpreted result
+static InterpretResult run()
+{
+    //the hot interpreter state lives in locals so the compiler can keep it in registers.
+    //the stack slot under sp[-1] is stale while its value is cached in tos, everything below it is always in memory.
+    //SPILL() writes the state back to the frame and the VM before anything that looks at it (calls, allocations that
+    //can run the GC and runtime errors), LOAD_FRAME() / RELOAD_STACK() read it back afterward.
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* slots;
+    Value* constants;
+    InlineCache* caches;
+    Value* sp;
+    Value tos;
+#ifdef CLOX_JIT
+    bool recording = false; // whether a hot loop's trace is being recorded, see jitRecord()
+#endif
+
+#define RELOAD_STACK() (sp = vm.stackTop, tos = sp[-1])
+#define LOAD_FRAME() \
+(frame = &vm.frames[vm.frameCount - 1], \
+ip = frame->ip, \
+slots = frame->slots, \
+constants = frame->closure->function->chunk.constants.values, \
+caches = frame->closure->function->chunk.caches, \
+RELOAD_STACK())
+#define SPILL() (frame->ip = ip, sp[-1] = tos, vm.stackTop = sp)
+
+    //the frame switches (calls and returns) and the back jumps hand the top frame to its function's machine code, if
+    //it has any, which runs until an instruction it leaves to the interpreter. while a trace is recorded everything
+    //runs in the interpreter
+#ifdef CLOX_JIT
+#define ENTER_JIT() \
+do { \
+if (!recording && frame->closure->function->jit != NULL) { \
+SPILL(); \
+jitRun(frame); \
+LOAD_FRAME(); \
+} \
+} while (false)
+#else
+#define ENTER_JIT() ((void)0)
+#endif
+
+    //stack operations on the cached top of the stack
+#define PUSH(value) do { sp[-1] = tos; tos = (value); sp++; } while (false)
+#define DROP() (sp--, tos = sp[-1])
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG(arr)  (constants[(uint32_t)arr[2] << 16 | (uint16_t)arr[1] << 8 | arr[0]])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_SHORT() ((ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1])))
+#define READ_CACHE() (&caches[READ_SHORT()])
+
+    //a macro to perform binary operations, once the operands are seen to be numbers the instruction is
+    //rewritten in place to its number-only variant
+#define BINARY_OP(valueType, op, numberOp) \
+do { \
+if (!IS_NUMBER(tos) || !IS_NUMBER(PEEK(1))) { \
+SPILL(); \
+runtimeError("Operands must be numbers."); \
+return INTERPRET_RUNTIME_ERROR; \
+} \
+ip[-1] = numberOp; \
+double b = AS_NUMBER(tos); \
+double a = AS_NUMBER(PEEK(1)); \
+sp--; \
+tos = valueType(a op b); \
+} while (false)
+
+    //re-executes a quickened instruction whose guard failed as the generic one, which specializes it again
+#define DESPECIALIZE(genericOp) \
+do { \
+ip[-1] = genericOp; \
+ip--; \
+DISPATCH(); \
+} while (false)
+
+    //a macro for the number-only binary operations
+#define NUMBER_OP(valueType, op, genericOp) \
+do { \
+if (!IS_NUMBER(tos) || !IS_NUMBER(PEEK(1))) DESPECIALIZE(genericOp); \
+double b = AS_NUMBER(tos); \
+double a = AS_NUMBER(PEEK(1)); \
+sp--; \
+tos = valueType(a op b); \
+} while (false)
+
+    //a check for a debug flag that if present prints the trace before every instruction
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() (SPILL(), traceExecution(frame))
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+    //hands every instruction to the trace recorder while a hot loop is recorded
+#ifdef CLOX_JIT
+#define RECORD_INSTRUCTION() (recording ? (void)(SPILL(), recording = jitRecord(frame)) : (void)0)
+#else
+#define RECORD_INSTRUCTION() ((void)0)
 #endif
 
+    //counts the executed instructions for the dispatch benchmark
+#ifdef CLOX_COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm.instructionCount++)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef CLOX_COMPUTED_GOTO
+    //every handler jumps straight to the next one through this table, giving each opcode its own indirect branch
+    static void* dispatchTable[] = {
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_POP] = &&op_OP_POP,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_CLASS] = &&op_OP_CLASS,
+        [OP_METHOD] = &&op_OP_METHOD,
+        [OP_INVOKE] = &&op_OP_INVOKE,
+        [OP_INHERIT] = &&op_OP_INHERIT,
+        [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+        [OP_ADD_LOCALS] = &&op_OP_ADD_LOCALS,
+        [OP_ADD_CONSTANT] = &&op_OP_ADD_CONSTANT,
+        [OP_SUBTRACT_CONSTANT] = &&op_OP_SUBTRACT_CONSTANT,
+        [OP_LESS_CONSTANT] = &&op_OP_LESS_CONSTANT,
+        [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+        [OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_ADD_STR] = &&op_OP_ADD_STR,
+        [OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM] = &&op_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM] = &&op_OP_DIVIDE_NUM,
+        [OP_LESS_NUM] = &&op_OP_LESS_NUM,
+        [OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(opcode) op_##opcode:
+#define DISPATCH() \
+do { \
+TRACE_INSTRUCTION(); \
+COUNT_INSTRUCTION(); \
+RECORD_INSTRUCTION(); \
+goto *dispatchTable[READ_BYTE()]; \
+} while (false)
+#else
+    //the portable fallback: a single switch that every instruction goes back through
+#define INTERPRET_LOOP for (;;) switch (TRACE_INSTRUCTION(), COUNT_INSTRUCTION(), RECORD_INSTRUCTION(), READ_BYTE())
+#define CASE(opcode) case opcode:
+#define DISPATCH() break
+#endif
+
+    LOAD_FRAME();
+
     //runs through all the instructions in the chunk and returns the runtime result from the interpretation
-    for (;;)
+    INTERPRET_LOOP
     {
-        uint8_t instruction;
-
-        //the switch is used to dispatch the instructions in the most simple way
-        switch (instruction = READ_BYTE())
-        {
         //the case negates the value in the top of the stacks and pushes it back in
-        case OP_NEGATE:
+        CASE(OP_NEGATE)
             //checks if the value on the top of the stack is a number
-            if (!IS_NUMBER(peek(0)))
+            if (!IS_NUMBER(tos))
             {
+                SPILL();
                 runtimeError("Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_CALL:
+            tos = NUMBER_VAL(-AS_NUMBER(tos));
+            DISPATCH();
+        CASE(OP_CALL)
             {
                 int argCount = READ_BYTE();
+                SPILL();
                 if (!callValue(peek(argCount), argCount))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                ENTER_JIT();
+                DISPATCH();
+            }
+        CASE(OP_TAIL_CALL)
+            {
+                int argCount = READ_BYTE();
+                Value callee = argCount == 0 ? tos : PEEK(argCount);
+                SPILL();
+
+                // anything but a closure with the right arity is called normally, and the following OP_RETURN
+                // returns its result
+                if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function->arity != argCount)
+                {
+                    if (!callValue(callee, argCount))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    ENTER_JIT();
+                    DISPATCH();
+                }
+
+                // the callee takes over the current frame: close its upvalues and slide the callee and the arguments
+                // down over its slots
+                closeUpvalues(slots);
+                memmove(slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+                vm.stackTop = slots + argCount + 1;
+
+                ObjClosure* closure = AS_CLOSURE(callee);
+                frame->closure = closure;
+                frame->ip = closure->function->chunk.code;
+                countCall(closure->function);
+                if (vm.stackLimit - vm.stackTop < STACK_HEADROOM && !growStack())
+                {
+                    runtimeError("Stack overflow.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                ENTER_JIT();
+                DISPATCH();
             }
         //end of run opcode
-        case OP_RETURN:
+        CASE(OP_RETURN)
             {
-                // pops the return value and remove the frame from the stack
-                Value result = pop();
-                closeUpvalues(frame->slots);
+                // takes the return value and remove the frame from the stack
+                Value result = tos;
+                closeUpvalues(slots);
                 vm.frameCount--;
                 // if the stack is empty, the program has finished
                 if (vm.frameCount == 0)
                 {
-                    pop();
+                    vm.stackTop = slots;
                     return INTERPRET_OK;
                 }
 
-                vm.stackTop = frame->slots;
-                push(result);
+                // the return value replaces the callee and its arguments
+                sp = slots + 1;
+                tos = result;
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                ip = frame->ip;
+                slots = frame->slots;
+                constants = frame->closure->function->chunk.constants.values;
+                caches = frame->closure->function->chunk.caches;
+                ENTER_JIT();
+                DISPATCH();
             }
         //case for a constant value. pushes the constants into the stack
-        case OP_CONSTANT:
-            {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                //printValue(constant);
-                //printf("\n");
-                break;
-            }
+        CASE(OP_CONSTANT)
+            PUSH(READ_CONSTANT());
+            DISPATCH();
         //the case handles the long constants, creates an array of the bytes and then build it as a value
-        case OP_CONSTANT_LONG:
+        CASE(OP_CONSTANT_LONG)
             {
-                //uint32_t constant = READ_CONSTANT_LONG();
                 uint8_t arr[] = {READ_BYTE(), READ_BYTE(), READ_BYTE()};
-                Value constant = READ_CONSTANT_LONG(arr);
-                push(constant);
-                //printValue(constant);
-                //printf("'\n");
-                break;
+                PUSH(READ_CONSTANT_LONG(arr));
+                DISPATCH();
             }
         //cases for nil,false and true
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
+        CASE(OP_NIL)
+            PUSH(NIL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE)
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE)
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
         //case for popping out of the stack
-        case OP_POP:
-            pop();
-            break;
+        CASE(OP_POP)
+            DROP();
+            DISPATCH();
         //case for reading from a global variable
-        case OP_GET_GLOBAL:
-            ObjString* name = READ_STRING();
-            Value value;
-            if (!tableGet(&vm.globals, name, &value))
+        CASE(OP_GET_GLOBAL)
             {
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
+                uint16_t slot = READ_SHORT();
+                Value value = vm.globalValues.values[slot];
+                if (IS_UNDEFINED(value))
+                {
+                    SPILL();
+                    runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                PUSH(value);
+                DISPATCH();
             }
-            push(value);
-            break;
-        case OP_SET_PROPERTY:
+        CASE(OP_SET_PROPERTY)
             {
-                if (!IS_INSTANCE(peek(1)))
+                ObjString* name = READ_STRING();
+                InlineCache* cache = READ_CACHE();
+                if (!IS_INSTANCE(PEEK(1)))
                 {
+                    SPILL();
                     runtimeError("Only instances have fields.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                push(value);
-                break;
+                ObjInstance* instance = AS_INSTANCE(PEEK(1));
+
+                // a cached store to an existing field, or one that adds a field when the instance has room for it
+                CacheEntry* entry = findCacheEntry(cache, instance->shape, instance->klass->version);
+                if (entry != NULL && entry->slot < instance->capacity)
+                {
+                    vm.propertyCacheStats.hits++;
+                    if (entry->transition != NULL) instance->shape = entry->transition;
+                    instance->fields[entry->slot] = tos;
+                }
+                else
+                {
+                    vm.propertyCacheStats.misses++;
+                    SPILL();
+                    setProperty(instance, name, tos, cache);
+                }
+
+                // the assigned value replaces the instance on the stack
+                sp--;
+                DISPATCH();
             }
         //case for equality
-        case OP_EQUAL:
+        CASE(OP_EQUAL)
             {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+                Value b = tos;
+                sp--;
+                tos = BOOL_VAL(valuesEqual(sp[-1], b));
+                DISPATCH();
             }
-        case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
-            break;
+        CASE(OP_GREATER)
+            BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+            DISPATCH();
+        CASE(OP_LESS)
+            BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+            DISPATCH();
         //cases for arithmetic operations
-        case OP_ADD:
+        CASE(OP_ADD)
             {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-                {
-                    concatenate();
-                }
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-                {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                }
-                else
+                if (IS_NUMBER(tos) && IS_NUMBER(PEEK(1)))
                 {
-                    runtimeError("Operands must be 2 numbers or 2 strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    ip[-1] = OP_ADD_NUM;
+                    double b = AS_NUMBER(tos);
+                    double a = AS_NUMBER(PEEK(1));
+                    sp--;
+                    tos = NUMBER_VAL(a + b);
+                    DISPATCH();
                 }
-                break;
+                if (IS_STRING(tos) && IS_STRING(PEEK(1))) ip[-1] = OP_ADD_STR;
+
+                SPILL();
+                if (!addNonNumbers()) return INTERPRET_RUNTIME_ERROR;
+                RELOAD_STACK();
+                DISPATCH();
             }
-        case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
-        case OP_PRINT:
-            printValue(pop());
+        CASE(OP_SUBTRACT)
+            BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+            DISPATCH();
+        CASE(OP_MULTIPLY)
+            BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+            DISPATCH();
+        CASE(OP_DIVIDE)
+            BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+            DISPATCH();
+        CASE(OP_NOT)
+            tos = BOOL_VAL(isFalsey(tos));
+            DISPATCH();
+        CASE(OP_PRINT)
+            printValue(tos);
             printf("\n");
-            break;
-        case OP_DEFINE_GLOBAL:
-            {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-        case OP_SET_GLOBAL:
+            DROP();
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL)
+            vm.globalValues.values[READ_SHORT()] = tos;
+            DROP();
+            DISPATCH();
+        CASE(OP_SET_GLOBAL)
             {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0)))
+                uint16_t slot = READ_SHORT();
+                if (IS_UNDEFINED(vm.globalValues.values[slot]))
                 {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                    SPILL();
+                    runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                vm.globalValues.values[slot] = tos;
+                DISPATCH();
             }
-        case OP_GET_LOCAL:
+        CASE(OP_GET_LOCAL)
             {
                 uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+                PUSH(slots[slot]);
+                DISPATCH();
             }
-        case OP_SET_LOCAL:
+        CASE(OP_SET_LOCAL)
             {
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+                slots[slot] = tos;
+                DISPATCH();
             }
-        case OP_JUMP_IF_FALSE:
+        CASE(OP_JUMP_IF_FALSE)
             {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+                if (isFalsey(tos)) ip += offset;
+                DISPATCH();
             }
-        case OP_JUMP:
+        CASE(OP_JUMP)
             {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                ip += offset;
+                DISPATCH();
             }
-        case OP_LOOP:
+        CASE(OP_LOOP)
             {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                LoopCounter* loop = &frame->closure->function->chunk.loops[READ_SHORT()];
+                ip -= offset;
+#ifdef CLOX_JIT
+                // a hot loop runs its trace, and the back edge that makes a loop hot starts recording one. nothing
+                // runs in native code while a trace is recorded, the recorder has to see every instruction of the path
+                if (!recording && loop->trace != NULL)
+                {
+                    SPILL();
+                    jitRunTrace(frame, loop);
+                    LOAD_FRAME();
+                }
+                else if (!recording && loop->count < vm.traceThreshold && ++loop->count == vm.traceThreshold)
+                {
+                    SPILL();
+                    recording = jitStartTrace(frame, loop);
+                }
+#else
+                (void)loop;
+#endif
+                ENTER_JIT();
+                DISPATCH();
             }
-        case OP_INVOKE:
+        CASE(OP_INVOKE)
             {
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
+                InlineCache* cache = READ_CACHE();
+                Value receiver = argCount == 0 ? tos : PEEK(argCount);
 
-                if (!invoke(method, argCount))
+                // on a cache hit the method (or the callable in a field) is called without any lookups
+                if (IS_INSTANCE(receiver))
+                {
+                    ObjInstance* instance = AS_INSTANCE(receiver);
+                    CacheEntry* entry = findCacheEntry(cache, instance->shape, instance->klass->version);
+                    if (entry != NULL)
+                    {
+                        vm.invokeCacheStats.hits++;
+                        SPILL();
+                        bool called;
+                        if (entry->slot == -1)
+                        {
+                            called = call(AS_CLOSURE(entry->method), argCount);
+                        }
+                        else
+                        {
+                            Value callee = instance->fields[entry->slot];
+                            vm.stackTop[-argCount - 1] = callee;
+                            called = callValue(callee, argCount);
+                        }
+                        if (!called) return INTERPRET_RUNTIME_ERROR;
+                        LOAD_FRAME();
+                        ENTER_JIT();
+                        DISPATCH();
+                    }
+                }
+
+                vm.invokeCacheStats.misses++;
+                SPILL();
+                if (!invoke(method, argCount, cache))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                ENTER_JIT();
+                DISPATCH();
             }
-        case OP_CLOSURE:
+        CASE(OP_CLOSURE)
             {
                 // Fetch the constant (function) to create a closure from the current chunk of bytecode.
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
 
-                // Create a new closure for the function
+                // Create a new closure for the function, capturing upvalues can run the GC so the closure stays spilled
+                SPILL();
                 ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
+                PUSH(OBJ_VAL(closure));
+                SPILL();
 
                 // For each upvalue handle its closure.
                 for (int i = 0; i < closure->upvalueCount; i++)
@@ -641,119 +1233,284 @@ push(valueType(a op b)); \
                     // If the upvalue is local, capture it from the current frame’s slots.
                     if (isLocal)
                     {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        closure->upvalues[i] = captureUpvalue(slots + index);
                     }
                     else // Otherwise, it's an upvalue from the enclosing closure. Copy it.
                     {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
-                break;
+                DISPATCH();
             }
-        case OP_GET_UPVALUE:
+        CASE(OP_GET_UPVALUE)
             {
                 uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+                PUSH(*frame->closure->upvalues[slot]->location);
+                DISPATCH();
             }
-        case OP_SET_UPVALUE:
+        CASE(OP_SET_UPVALUE)
             {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                *frame->closure->upvalues[slot]->location = tos;
+                DISPATCH();
             }
-        case OP_CLOSE_UPVALUE:
+        CASE(OP_CLOSE_UPVALUE)
             {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+                sp[-1] = tos;
+                closeUpvalues(sp - 1);
+                DROP();
+                DISPATCH();
             }
-        case OP_CLASS:
-            push(OBJ_VAL(newClass(READ_STRING())));
-            break;
-        case OP_GET_PROPERTY:
+        CASE(OP_CLASS)
+            {
+                ObjString* name = READ_STRING();
+                SPILL();
+                PUSH(OBJ_VAL(newClass(name)));
+                DISPATCH();
+            }
+        CASE(OP_GET_PROPERTY)
             {
                 // Check if the value at the top of the stack is an instance. Properties are only available on instances.
-                if (!IS_INSTANCE(peek(0)))
+                if (!IS_INSTANCE(tos))
                 {
+                    SPILL();
                     runtimeError("Only instances have properties.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjInstance* instance = AS_INSTANCE(peek(0));
+                ObjInstance* instance = AS_INSTANCE(tos);
                 ObjString* name = READ_STRING();
+                InlineCache* cache = READ_CACHE();
 
-                Value value;
-                // Try to get the property value from the instance's fields.
-                if (tableGet(&instance->fields, name, &value))
+                // on a cache hit the field is one indexed load, and a method only needs binding
+                CacheEntry* entry = findCacheEntry(cache, instance->shape, instance->klass->version);
+                if (entry != NULL)
                 {
-                    pop();
-                    push(value);
-                    break;
+                    vm.propertyCacheStats.hits++;
+                    if (entry->slot != -1)
+                    {
+                        tos = instance->fields[entry->slot];
+                        DISPATCH();
+                    }
+                    SPILL();
+                    tos = OBJ_VAL(newBoundMethod(tos, AS_CLOSURE(entry->method)));
+                    DISPATCH();
                 }
-                // If the property doesn't exist in the instance's fields, try binding a method from the class.
-                if (!bindMethod(instance->klass, name))
+
+                vm.propertyCacheStats.misses++;
+                SPILL();
+                if (!getProperty(instance, name, cache))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-
-                break;
+                RELOAD_STACK();
+                DISPATCH();
             }
-        case OP_METHOD:
+        CASE(OP_METHOD)
             {
-                defineMethod(READ_STRING());
-                break;
+                ObjString* name = READ_STRING();
+                SPILL();
+                defineMethod(name);
+                RELOAD_STACK();
+                DISPATCH();
             }
-        case OP_INHERIT:
+        CASE(OP_INHERIT)
             {
                 // Get the value of the superclass, which is located at the second-to-top position on the stack.
-                Value superclass = peek(1);
+                Value superclass = PEEK(1);
 
                 // Check if the value of the superclass is actually a class. If not, show a runtime error.
                 if (!IS_CLASS(superclass))
                 {
+                    SPILL();
                     runtimeError("Superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                ObjClass* subclass = AS_CLASS(peek(0));
+                ObjClass* subclass = AS_CLASS(tos);
+                SPILL();
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
-                break;
+                subclass->version++;
+                DROP();
+                DISPATCH();
             }
-        case OP_GET_SUPER:
+        CASE(OP_GET_SUPER)
             {
                 ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-
-                //checks if the method is actually bound
-                if (!bindMethod(superclass, name))
+                InlineCache* cache = READ_CACHE();
+                ObjClass* superclass = AS_CLASS(tos);
+                DROP();
+                SPILL();
+
+                Value method;
+                CacheEntry* entry = findCacheEntry(cache, superclass->rootShape, superclass->version);
+                if (entry != NULL)
                 {
-                    return INTERPRET_RUNTIME_ERROR;
+                    vm.invokeCacheStats.hits++;
+                    method = entry->method;
+                }
+                else
+                {
+                    vm.invokeCacheStats.misses++;
+                    if (!findSuperMethod(superclass, name, cache, &method)) return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+
+                // the bound method replaces the receiver
+                tos = OBJ_VAL(newBoundMethod(tos, AS_CLOSURE(method)));
+                DISPATCH();
             }
-        case OP_SUPER_INVOKE:
+        CASE(OP_SUPER_INVOKE)
             {
-                ObjString* method = READ_STRING();
+                ObjString* name = READ_STRING();
                 int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
+                InlineCache* cache = READ_CACHE();
+                ObjClass* superclass = AS_CLASS(tos);
+                DROP();
+                SPILL();
+
+                Value method;
+                CacheEntry* entry = findCacheEntry(cache, superclass->rootShape, superclass->version);
+                if (entry != NULL)
+                {
+                    vm.invokeCacheStats.hits++;
+                    method = entry->method;
+                }
+                else
+                {
+                    vm.invokeCacheStats.misses++;
+                    if (!findSuperMethod(superclass, name, cache, &method)) return INTERPRET_RUNTIME_ERROR;
+                }
 
-                if (!invokeFromClass(superclass, method, argCount))
+                if (!call(AS_CLOSURE(method), argCount))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                LOAD_FRAME();
+                ENTER_JIT();
+                DISPATCH();
+            }
+        //superinstructions, see the sequences they replace in chunk.h
+        CASE(OP_ADD_LOCALS)
+            {
+                // the second local can be the cached top of the stack
+                sp[-1] = tos;
+                Value a = slots[READ_BYTE()];
+                Value b = slots[READ_BYTE()];
+                if (IS_NUMBER(a) && IS_NUMBER(b))
+                {
+                    PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                    DISPATCH();
+                }
 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                PUSH(a);
+                PUSH(b);
+                SPILL();
+                if (!addNonNumbers()) return INTERPRET_RUNTIME_ERROR;
+                RELOAD_STACK();
+                DISPATCH();
             }
-        }
+        CASE(OP_ADD_CONSTANT)
+            {
+                Value b = READ_CONSTANT();
+                if (IS_NUMBER(tos) && IS_NUMBER(b))
+                {
+                    tos = NUMBER_VAL(AS_NUMBER(tos) + AS_NUMBER(b));
+                    DISPATCH();
+                }
+
+                PUSH(b);
+                SPILL();
+                if (!addNonNumbers()) return INTERPRET_RUNTIME_ERROR;
+                RELOAD_STACK();
+                DISPATCH();
+            }
+        CASE(OP_SUBTRACT_CONSTANT)
+            {
+                Value b = READ_CONSTANT();
+                if (!IS_NUMBER(tos) || !IS_NUMBER(b))
+                {
+                    SPILL();
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                tos = NUMBER_VAL(AS_NUMBER(tos) - AS_NUMBER(b));
+                DISPATCH();
+            }
+        CASE(OP_LESS_CONSTANT)
+            {
+                Value b = READ_CONSTANT();
+                if (!IS_NUMBER(tos) || !IS_NUMBER(b))
+                {
+                    SPILL();
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                tos = BOOL_VAL(AS_NUMBER(tos) < AS_NUMBER(b));
+                DISPATCH();
+            }
+        CASE(OP_SET_LOCAL_POP)
+            {
+                uint8_t slot = READ_BYTE();
+                slots[slot] = tos;
+                DROP();
+                DISPATCH();
+            }
+        CASE(OP_POP_JUMP_IF_FALSE)
+            {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(tos)) ip += offset;
+                DROP();
+                DISPATCH();
+            }
+        //quickened instructions, the generic ones rewrite themselves to these after seeing their operand types
+        CASE(OP_ADD_NUM)
+            NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+            DISPATCH();
+        CASE(OP_ADD_STR)
+            {
+                if (!IS_STRING(tos) || !IS_STRING(PEEK(1))) DESPECIALIZE(OP_ADD);
+                SPILL();
+                concatenate();
+                RELOAD_STACK();
+                DISPATCH();
+            }
+        CASE(OP_SUBTRACT_NUM)
+            NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+            DISPATCH();
+        CASE(OP_MULTIPLY_NUM)
+            NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+            DISPATCH();
+        CASE(OP_DIVIDE_NUM)
+            NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+            DISPATCH();
+        CASE(OP_LESS_NUM)
+            NUMBER_OP(BOOL_VAL, <, OP_LESS);
+            DISPATCH();
+        CASE(OP_GREATER_NUM)
+            NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+            DISPATCH();
     }
+#undef RELOAD_STACK
+#undef LOAD_FRAME
+#undef SPILL
+#undef ENTER_JIT
+#undef PUSH
+#undef DROP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_CONSTANT_LONG
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_CACHE
 #undef BINARY_OP
+#undef DESPECIALIZE
+#undef NUMBER_OP
+#undef TRACE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef RECORD_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 /// interprets a given chunk to the VM and returns the interpreted result
@@ -764,7 +1521,14 @@ InterpretResult interpret(const char* source)
     //compiles the source code and save the main function to interpret
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(function);
+}
 
+/// runs a script that is already compiled
+/// @param function the script's top level function
+/// @return         the result of the run
+InterpretResult interpretFunction(ObjFunction* function)
+{
     //pushes the main function onto the stack
     push(OBJ_VAL(function));
     // calls the top level function to initialize the VM
@@ -773,6 +1537,287 @@ InterpretResult interpret(const char* source)
     push(OBJ_VAL(closure));
     call(closure, 0);
 
+#ifdef CLOX_COUNT_INSTRUCTIONS
+    //reports the dispatch throughput for the benchmark builds
+    vm.instructionCount = 0;
+    clock_t start = clock();
+    InterpretResult result = run();
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    fprintf(stderr, "%llu instructions in %.3f s (%.1f M instructions/s)\n",
+            (unsigned long long)vm.instructionCount, seconds,
+            seconds > 0 ? vm.instructionCount / seconds / 1e6 : 0.0);
+    return result;
+#else
     //interprets the code and returns the run result
     return run();
+#endif
+}
+
+/// runs the frames a call from compiled code pushed until they have returned, following tail calls. natives and
+/// classes without an initializer push none
+/// @param frameCount the number of frames before the call
+/// @return           false after a runtime error
+static bool runCompiled(int frameCount)
+{
+    while (vm.frameCount > frameCount)
+    {
+        if (vm.frames[vm.frameCount - 1].closure->function->compiled() == COMPILED_ERROR) return false;
+    }
+    return true;
+}
+
+/// OP_CALL in compiled code: calls the callee under the arguments and runs it to its return
+/// @param argCount the number of arguments
+/// @return         false after a runtime error
+bool aotCall(int argCount)
+{
+    int frameCount = vm.frameCount;
+    return callValue(peek(argCount), argCount) && runCompiled(frameCount);
+}
+
+/// OP_TAIL_CALL in compiled code: a closure with the right arity takes over the caller's frame, anything else is
+/// called normally and its result returned by the OP_RETURN that follows
+/// @param argCount the number of arguments
+/// @return         COMPILED_TAIL_CALL if the frame now belongs to the callee, COMPILED_RETURN once a normal call
+///                 returned
+CompiledStatus aotTailCall(int argCount)
+{
+    Value callee = peek(argCount);
+    if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function->arity != argCount)
+    {
+        return aotCall(argCount) ? COMPILED_RETURN : COMPILED_ERROR;
+    }
+
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->closure = AS_CLOSURE(callee);
+    frame->ip = frame->closure->function->chunk.code;
+    if (vm.stackLimit - vm.stackTop < STACK_HEADROOM && !growStack())
+    {
+        runtimeError("Stack overflow.");
+        return COMPILED_ERROR;
+    }
+    return COMPILED_TAIL_CALL;
+}
+
+/// OP_INVOKE in compiled code, through the instruction's inline cache like the interpreter
+/// @param name     the method name
+/// @param argCount the number of arguments
+/// @param cache    the inline cache of the instruction
+/// @return         false after a runtime error
+bool aotInvoke(ObjString* name, int argCount, InlineCache* cache)
+{
+    int frameCount = vm.frameCount;
+    Value receiver = peek(argCount);
+    CacheEntry* entry = NULL;
+    if (IS_INSTANCE(receiver))
+    {
+        entry = findCacheEntry(cache, AS_INSTANCE(receiver)->shape, AS_INSTANCE(receiver)->klass->version);
+    }
+
+    bool called;
+    if (entry == NULL)
+    {
+        vm.invokeCacheStats.misses++;
+        called = invoke(name, argCount, cache);
+    }
+    else if (entry->slot == -1)
+    {
+        vm.invokeCacheStats.hits++;
+        called = call(AS_CLOSURE(entry->method), argCount);
+    }
+    else
+    {
+        vm.invokeCacheStats.hits++;
+        Value callee = AS_INSTANCE(receiver)->fields[entry->slot];
+        vm.stackTop[-argCount - 1] = callee;
+        called = callValue(callee, argCount);
+    }
+    return called && runCompiled(frameCount);
+}
+
+/// looks up a method of the superclass on top of the stack through an inline cache and pops the superclass
+/// @param name   the method name
+/// @param cache  the inline cache of the instruction
+/// @param method an output parameter for the method's closure
+/// @return       false after a runtime error
+static bool superMethod(ObjString* name, InlineCache* cache, Value* method)
+{
+    ObjClass* superclass = AS_CLASS(pop());
+    CacheEntry* entry = findCacheEntry(cache, superclass->rootShape, superclass->version);
+    if (entry != NULL)
+    {
+        vm.invokeCacheStats.hits++;
+        *method = entry->method;
+        return true;
+    }
+    vm.invokeCacheStats.misses++;
+    return findSuperMethod(superclass, name, cache, method);
+}
+
+/// OP_SUPER_INVOKE in compiled code
+/// @param name     the method name
+/// @param argCount the number of arguments
+/// @param cache    the inline cache of the instruction
+/// @return         false after a runtime error
+bool aotSuperInvoke(ObjString* name, int argCount, InlineCache* cache)
+{
+    int frameCount = vm.frameCount;
+    Value method;
+    return superMethod(name, cache, &method) && call(AS_CLOSURE(method), argCount) && runCompiled(frameCount);
+}
+
+/// OP_GET_SUPER in compiled code, replaces the receiver with the bound method
+/// @param name  the method name
+/// @param cache the inline cache of the instruction
+/// @return      false after a runtime error
+bool aotGetSuper(ObjString* name, InlineCache* cache)
+{
+    Value method;
+    if (!superMethod(name, cache, &method)) return false;
+    vm.stackTop[-1] = OBJ_VAL(newBoundMethod(peek(0), AS_CLOSURE(method)));
+    return true;
+}
+
+/// OP_GET_PROPERTY in compiled code, replaces the instance with the property's value
+/// @param name  the property name
+/// @param cache the inline cache of the instruction
+/// @return      false after a runtime error
+bool aotGetProperty(ObjString* name, InlineCache* cache)
+{
+    if (!IS_INSTANCE(peek(0)))
+    {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(0));
+    CacheEntry* entry = findCacheEntry(cache, instance->shape, instance->klass->version);
+    if (entry == NULL)
+    {
+        vm.propertyCacheStats.misses++;
+        return getProperty(instance, name, cache);
+    }
+
+    vm.propertyCacheStats.hits++;
+    if (entry->slot != -1)
+    {
+        vm.stackTop[-1] = instance->fields[entry->slot];
+    }
+    else
+    {
+        vm.stackTop[-1] = OBJ_VAL(newBoundMethod(peek(0), AS_CLOSURE(entry->method)));
+    }
+    return true;
+}
+
+/// OP_SET_PROPERTY in compiled code, the assigned value replaces the instance under it
+/// @param name  the field name
+/// @param cache the inline cache of the instruction
+/// @return      false after a runtime error
+bool aotSetProperty(ObjString* name, InlineCache* cache)
+{
+    if (!IS_INSTANCE(peek(1)))
+    {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(1));
+    CacheEntry* entry = findCacheEntry(cache, instance->shape, instance->klass->version);
+    if (entry != NULL && entry->slot < instance->capacity)
+    {
+        vm.propertyCacheStats.hits++;
+        if (entry->transition != NULL) instance->shape = entry->transition;
+        instance->fields[entry->slot] = peek(0);
+    }
+    else
+    {
+        vm.propertyCacheStats.misses++;
+        setProperty(instance, name, peek(0), cache);
+    }
+
+    Value value = pop();
+    vm.stackTop[-1] = value;
+    return true;
+}
+
+/// OP_CLOSURE in compiled code, pushes a closure capturing the upvalues the instruction lists
+/// @param function the closure's function
+/// @param upvalues the instruction's upvalue operands, an is-local flag and an index for each upvalue
+void aotClosure(ObjFunction* function, uint8_t* upvalues)
+{
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    ObjClosure* closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++)
+    {
+        uint8_t index = upvalues[2 * i + 1];
+        closure->upvalues[i] = upvalues[2 * i] ? captureUpvalue(frame->slots + index) : frame->closure->upvalues[index];
+    }
+}
+
+/// OP_CLOSE_UPVALUE and OP_RETURN in compiled code
+/// @param last the lowest stack slot whose upvalues get closed
+void aotCloseUpvalues(Value* last)
+{
+    closeUpvalues(last);
+}
+
+/// OP_CLASS in compiled code
+/// @param name the class name
+void aotClass(ObjString* name)
+{
+    push(OBJ_VAL(newClass(name)));
+}
+
+/// OP_METHOD in compiled code, the method under the class on the stack
+/// @param name the method name
+void aotMethod(ObjString* name)
+{
+    defineMethod(name);
+}
+
+/// OP_INHERIT in compiled code, copies the superclass's methods into the subclass and pops the subclass
+/// @return false after a runtime error
+bool aotInherit()
+{
+    if (!IS_CLASS(peek(1)))
+    {
+        runtimeError("Superclass must be a class.");
+        return false;
+    }
+
+    ObjClass* subclass = AS_CLASS(peek(0));
+    tableAddAll(&AS_CLASS(peek(1))->methods, &subclass->methods);
+    subclass->version++;
+    pop();
+    return true;
+}
+
+/// OP_ADD in compiled code for anything but two numbers
+/// @return false after a runtime error
+bool aotAdd()
+{
+    return addNonNumbers();
+}
+
+/// reports a runtime error from compiled code
+/// @param message the error message
+/// @return        COMPILED_ERROR, for the body to return
+CompiledStatus aotError(const char* message)
+{
+    runtimeError("%s", message);
+    return COMPILED_ERROR;
+}
+
+/// reports a compiled access to a global variable that was never defined
+/// @param slot the variable's global slot
+/// @return     COMPILED_ERROR, for the body to return
+CompiledStatus aotUndefinedVariable(int slot)
+{
+    runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+    return COMPILED_ERROR;
 }
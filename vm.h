@@ -6,8 +6,14 @@
 #include "value.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX*UINT8_COUNT)
+// the stacks start small and double when a call needs more room, up to FRAMES_MAX nested calls
+#define FRAMES_MAX (1024 * 1024)
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 1024
+// the free slots guaranteed above the stack top when a function starts: its locals plus its temporaries
+#define STACK_HEADROOM (2 * UINT8_COUNT)
+// the number of innermost and outermost frames a runtime error's stack trace shows
+#define TRACE_FRAMES 16
 
 typedef struct
 {
@@ -16,14 +22,30 @@ typedef struct
     Value* slots;
 } CallFrame;
 
+// inline cache counters, kept for the whole run and printed by --ic-stats
 typedef struct
 {
-    CallFrame frames[FRAMES_MAX];
+    uint64_t hits;
+    uint64_t misses;
+    int polymorphic;  // caches that went past one entry
+    int megamorphic;  // caches that gave up
+} CacheStats;
+
+typedef struct
+{
+    CallFrame* frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    size_t framesSize;  // the mapped size of the frame stack, in bytes
+    Value* stack;
     Value* stackTop;
+    Value* stackLimit;  // the end of the value stack, the guard page starts here
+    size_t stackSize;   // the mapped size of the value stack, in bytes
     Table strings;
-    Table globals;
+    // global variables live in a flat array, the compiler gives every global name a slot in it
+    Table globalSlots;       // global name -> slot, stored as a number
+    ValueArray globalValues; // UNDEFINED_VAL until the variable is defined
+    ValueArray globalNames;  // the name of each slot, for error messages
     ObjString* initString;
     ObjUpvalue* openUpvalues;
     size_t bytesAllocated;
@@ -32,6 +54,15 @@ typedef struct
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    CacheStats propertyCacheStats;
+    CacheStats invokeCacheStats;
+#ifdef CLOX_COUNT_INSTRUCTIONS
+    uint64_t instructionCount;
+#endif
+#ifdef CLOX_JIT
+    int jitThreshold;   // the calls before a function is compiled, 0 turns the JIT off
+    int traceThreshold; // the back edges before a loop is recorded as a trace, 0 turns tracing off
+#endif
 } VM;
 
 typedef enum
@@ -49,6 +80,12 @@ void freeVM();
 
 InterpretResult interpret(const char* source);
 
+InterpretResult interpretFunction(ObjFunction* function);
+
+int globalSlot(ObjString* name);
+
+void printCacheStats();
+
 void push(Value val);
 
 Value pop();